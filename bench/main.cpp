@@ -0,0 +1,62 @@
+// Standalone benchmark: the emulator's --bench without Bluetooth. Synthetic
+// keyboard, mouse flick and mixed streams go through the report pipeline
+// into a loopback host; takes the flags that shape the reports.
+#include "bthid.h"
+#include <getopt.h>
+
+void usage(const char *prog) {
+    std::cerr << "Usage: " << prog << " [options]\n"
+              << "      --hires       16-bit mouse axes, horizontal and high resolution wheel\n"
+              << "      --nkro        n-key rollover keyboard report instead of 6 keys\n"
+              << "      --pointer [MATCH=]SENS[,ACCEL[,THRESHOLD]]  pointer curve, as for the emulator\n"
+              << "      --keymap FILE remap keys as the emulator would\n"
+              << "      --io-uring    send reports through io_uring\n"
+              << "  -h, --help        show this help" << std::endl;
+}
+
+int main(int argc, char **argv) {
+    static const struct option long_opts[] = {
+        { "hires",     no_argument,       nullptr, 'H' },
+        { "nkro",      no_argument,       nullptr, 'N' },
+        { "pointer",   required_argument, nullptr, 'A' },
+        { "keymap",    required_argument, nullptr, 'Y' },
+        { "io-uring",  no_argument,       nullptr, 'I' },
+        { "help",      no_argument,       nullptr, 'h' },
+        { nullptr, 0, nullptr, 0 }
+    };
+    const char *keymap_path = nullptr;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "h", long_opts, nullptr)) != -1) {
+        switch (opt) {
+            case 'H':
+                mouse_hires = true;
+                break;
+            case 'N':
+                keyboard_nkro = true;
+                break;
+            case 'A':
+                if (!add_pointer_curve(optarg)) {
+                    std::cerr << "Bad pointer curve: " << optarg << std::endl;
+                    return 1;
+                }
+                break;
+            case 'Y':
+                keymap_path = optarg;
+                break;
+            case 'I':
+                use_io_uring = true;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return 0;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (!init_pipeline(nullptr, nullptr, keymap_path)) {
+        return 1;
+    }
+    return run_benchmark();
+}
@@ -1,21 +1,8 @@
-#include <iostream>
-#include <string>
-#include <vector>
-#include <fcntl.h>
-#include <unistd.h>
-#include <poll.h>
-#include <cerrno>
-#include <cstring>
-#include <csignal>
-#include <dirent.h>
-#include <algorithm> // Required for std::min/std::max
-#include <cmath> // Required for round()
-#include <chrono>
-#include <map>
-using namespace std::chrono;
-
-#include <linux/input.h>
-#include <sys/ioctl.h>
+// Bluetooth HID keyboard and mouse emulator. Everything that needs BlueZ
+// lives here: the SDP record, the L2CAP transport and option parsing; the
+// rest of the pipeline is in the bthid core library.
+#include "bthid.h"
+#include <getopt.h>
 
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/hci.h>
@@ -30,58 +17,6 @@ using namespace std::chrono;
 #define	HIDINFO_NAME	"Woolly HID Emulator"
 #define	HIDINFO_PROV	"Woolly"
 #define	HIDINFO_DESC	"Keyboard and Mouse"
-#define	REPORTID_MOUSE	1
-#define	REPORTID_KEYBD	2
-#define SDPRECORD	"\x05\x01\x09\x02\xA1\x01\x85\x01\x09\x01\xA1\x00" \
-			"\x05\x09\x19\x01\x29\x03\x15\x00\x25\x01\x75\x01" \
-			"\x95\x03\x81\x02\x75\x05\x95\x01\x81\x03\x05\x01" \
-			"\x09\x30\x09\x31\x09\x38\x15\x81\x25\x7F\x75\x08" \
-			"\x95\x03\x81\x06\xC0\xC0\x05\x01\x09\x06\xA1\x01" \
-			"\x85\x02\xA1\x00\x05\x07\x19\xE0\x29\xE7\x15\x00" \
-			"\x25\x01\x75\x01\x95\x08\x81\x02\x95\x08\x75\x08" \
-			"\x15\x00\x25\x65\x05\x07\x19\x00\x29\x65\x81\x00" \
-			"\xC0\xC0"
-#define SDPRECORD_BYTES	98
-
-// Globals
-volatile bool keep_running = true;
-int ctl_sock = -1, int_sock = -1;
-int ctl_conn = -1, int_conn = -1;
-sdp_session_t *sdp_session = nullptr;
-std::vector<int> event_fds;
-
-// HID report structures
-struct hidrep_mouse_t {
-	unsigned char	btcode;
-	unsigned char	rep_id;
-	unsigned char	button;
-	signed   char	axis_x;
-	signed   char	axis_y;
-	signed   char	axis_z;
-} __attribute__((packed));
-
-struct hidrep_keyb_t {
-	unsigned char	btcode;
-	unsigned char	rep_id;
-	unsigned char	modify;
-	unsigned char	key[8];
-} __attribute__((packed));
-
-// State for HID reports
-char mousebuttons = 0;
-char modifierkeys = 0;
-char pressedkey[8] = { 0, 0, 0, 0,  0, 0, 0, 0 };
-double dx = 0.0, dy = 0.0, dz = 0.0; // Use double for accumulators to maintain precision
-
-void signal_handler(int signum) {
-    std::cout << "\nCaught signal " << signum << ", shutting down." << std::endl;
-    keep_running = false;
-    // Forcefully close listening sockets to unblock accept() calls
-    if (ctl_sock >= 0) close(ctl_sock);
-    if (int_sock >= 0) close(int_sock);
-    ctl_sock = -1;
-    int_sock = -1;
-}
 
 // This function is a workaround for a bug in the bluez library.
 // The sdp_record_register function can cause a segmentation fault if the
@@ -179,11 +114,11 @@ sdp_session_t *register_hid_service() {
 
     dtds[0] = &dtd2;
     values[0] = &hid_spec_type;
-    dtd_data = SDPRECORD_BYTES <= 255 ? SDP_TEXT_STR8 : SDP_TEXT_STR16;
+    dtd_data = hid_descriptor.size() <= 255 ? SDP_TEXT_STR8 : SDP_TEXT_STR16;
     dtds[1] = &dtd_data;
-    values[1] = (uint8_t *)SDPRECORD;
+    values[1] = (uint8_t *)hid_descriptor.data();
     leng[0] = 0;
-    leng[1] = SDPRECORD_BYTES;
+    leng[1] = hid_descriptor.size();
     hid_spec_lst = sdp_seq_alloc_with_length(dtds, values, leng, 2);
     hid_spec_lst2 = sdp_data_alloc(SDP_SEQ8, hid_spec_lst);
     sdp_attr_add(&record, SDP_ATTR_HID_DESCRIPTOR_LIST, hid_spec_lst2);
@@ -209,382 +144,289 @@ sdp_session_t *register_hid_service() {
     return session;
 }
 
-void close_event_devices() {
-    for (int fd : event_fds) {
-        if (fd >= 0) {
-            ioctl(fd, EVIOCGRAB, 0); // Release grab
-            close(fd);
-        }
-    }
-    event_fds.clear();
-    std::cout << "Released input devices." << std::endl;
-}
+bool l2cap_open_listeners() {
+    ctl_sock = socket(AF_BLUETOOTH, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, BTPROTO_L2CAP);
+    int_sock = socket(AF_BLUETOOTH, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, BTPROTO_L2CAP);
 
+    if (ctl_sock < 0 || int_sock < 0) {
+        std::cerr << "Error creating sockets: " << strerror(errno) << std::endl;
+        return false;
+    }
 
+    struct sockaddr_l2 addr = { 0 };
+    addr.l2_family = AF_BLUETOOTH;
+    addr.l2_psm = htobs(PSMHIDCTL);
+    bdaddr_t bdaddr_any = {0,0,0,0,0,0};
+    bacpy(&addr.l2_bdaddr, &bdaddr_any);
 
-int grab_device(const std::string& path, unsigned long ev_type) {
-    int fd = open(path.c_str(), O_RDONLY | O_NONBLOCK);
-    if (fd < 0) {
-        return -1;
+    if (bind(ctl_sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        std::cerr << "Error binding control socket: " << strerror(errno) << std::endl;
+        return false;
     }
 
-    unsigned long ev_bits = 0;
-    ioctl(fd, EVIOCGBIT(0, sizeof(ev_bits)), &ev_bits);
-    if (!((1UL << ev_type) & ev_bits)) {
-        close(fd);
-        return -1;
+    addr.l2_psm = htobs(PSMHIDINT);
+    if (bind(int_sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        std::cerr << "Error binding interrupt socket: " << strerror(errno) << std::endl;
+        return false;
     }
 
-    if (ioctl(fd, EVIOCGRAB, 1) == 0) {
-        char name[256] = "Unknown";
-        ioctl(fd, EVIOCGNAME(sizeof(name)), name);
-        std::cout << "Grabbed device: " << path << " (" << name << ")" << std::endl;
-        return fd;
-    } else {
-        std::cerr << "Could not grab device " << path << ". Are you root?" << std::endl;
-        close(fd);
-        return -1;
+    if (listen(ctl_sock, HOSTS_MAX) < 0 || listen(int_sock, HOSTS_MAX) < 0) {
+        std::cerr << "Error listening on sockets: " << strerror(errno) << std::endl;
+        return false;
     }
+    return true;
 }
 
-int init_event_devices() {
-    // Open and grab selected devices
-    std::cout << "Delaying 2 seconds before grabbing devices..." << std::endl;
-    sleep(2);
+int l2cap_accept_channel(int listener, std::string *peer) {
+    struct sockaddr_l2 rem_addr = { 0 };
+    socklen_t opt = sizeof(rem_addr);
 
-    const std::string input_dir = "/dev/input/";
-    DIR *dir = opendir(input_dir.c_str());
-    if (!dir) {
-        std::cerr << "Could not open /dev/input/. Is this a Linux system?" << std::endl;
-        return -1;
-    }
+    int sock = accept4(listener, (struct sockaddr *)&rem_addr, &opt, SOCK_CLOEXEC);
+    if (sock < 0) return -1;
 
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != nullptr) {
-        if (strncmp(entry->d_name, "event", 5) != 0) {
-            continue;
-        }
-
-        std::string path = input_dir + entry->d_name;
-        int fd = -1;
-
-        char name[256] = "Unknown";
-        int temp_fd = open(path.c_str(), O_RDONLY | O_NONBLOCK);
-        if (temp_fd < 0) {
-            continue;
-        }
-        ioctl(temp_fd, EVIOCGNAME(sizeof(name)), name);
-        close(temp_fd);
+    char addr_str[18];
+    ba2str(&rem_addr.l2_bdaddr, addr_str);
+    *peer = addr_str;
+    return sock;
+}
 
-        if (strstr(name, "keyboard") != nullptr || strstr(name, "Keyboard") != nullptr) {
-            fd = grab_device(path, EV_KEY);
-        } else if (strstr(name, "mouse") != nullptr || strstr(name, "Mouse") != nullptr) {
-            fd = grab_device(path, EV_REL);
-        }
+// Device-initiated reconnection. connect() only starts paging the host;
+// the main loop learns the outcome from EPOLLOUT and SO_ERROR.
+int l2cap_connect_channel(const std::string& peer, bool interrupt) {
+    bdaddr_t dst;
+    if (str2ba(peer.c_str(), &dst) < 0) return -1;
 
-        if (fd >= 0) {
-            event_fds.push_back(fd);
-        }
-    }
-    closedir(dir);
+    int sock = socket(AF_BLUETOOTH, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, BTPROTO_L2CAP);
+    if (sock < 0) return -1;
 
-    if (event_fds.empty()) {
-        std::cerr << "No suitable keyboard or mouse found in /dev/input/" << std::endl;
+    struct sockaddr_l2 addr = { 0 };
+    addr.l2_family = AF_BLUETOOTH;
+    addr.l2_psm = htobs(interrupt ? PSMHIDINT : PSMHIDCTL);
+    bacpy(&addr.l2_bdaddr, &dst);
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+        close(sock);
         return -1;
     }
-
-    return event_fds.size();
+    return sock;
 }
 
-unsigned char map_key_to_hid(int code) {
-    static const std::map<int, unsigned char> key_map = {
-        {KEY_A, 4}, {KEY_B, 5}, {KEY_C, 6}, {KEY_D, 7}, {KEY_E, 8},
-        {KEY_F, 9}, {KEY_G, 10}, {KEY_H, 11}, {KEY_I, 12}, {KEY_J, 13},
-        {KEY_K, 14}, {KEY_L, 15}, {KEY_M, 16}, {KEY_N, 17}, {KEY_O, 18},
-        {KEY_P, 19}, {KEY_Q, 20}, {KEY_R, 21}, {KEY_S, 22}, {KEY_T, 23},
-        {KEY_U, 24}, {KEY_V, 25}, {KEY_W, 26}, {KEY_X, 27}, {KEY_Y, 28},
-        {KEY_Z, 29}, {KEY_1, 30}, {KEY_2, 31}, {KEY_3, 32}, {KEY_4, 33},
-        {KEY_5, 34}, {KEY_6, 35}, {KEY_7, 36}, {KEY_8, 37}, {KEY_9, 38},
-        {KEY_0, 39}, {KEY_ENTER, 40}, {KEY_ESC, 41}, {KEY_BACKSPACE, 42},
-        {KEY_TAB, 43}, {KEY_SPACE, 44}, {KEY_MINUS, 45}, {KEY_EQUAL, 46},
-        {KEY_LEFTBRACE, 47}, {KEY_RIGHTBRACE, 48}, {KEY_BACKSLASH, 49},
-        {KEY_SEMICOLON, 51}, {KEY_APOSTROPHE, 52}, {KEY_GRAVE, 53},
-        {KEY_COMMA, 54}, {KEY_DOT, 55}, {KEY_SLASH, 56}, {KEY_CAPSLOCK, 57},
-        {KEY_F1, 58}, {KEY_F2, 59}, {KEY_F3, 60}, {KEY_F4, 61}, {KEY_F5, 62},
-        {KEY_F6, 63}, {KEY_F7, 64}, {KEY_F8, 65}, {KEY_F9, 66}, {KEY_F10, 67},
-        {KEY_F11, 68}, {KEY_F12, 69}, {KEY_SYSRQ, 70}, {KEY_SCROLLLOCK, 71},
-        {KEY_PAUSE, 72}, {KEY_INSERT, 73}, {KEY_HOME, 74}, {KEY_PAGEUP, 75},
-        {KEY_DELETE, 76}, {KEY_END, 77}, {KEY_PAGEDOWN, 78}, {KEY_RIGHT, 79},
-        {KEY_LEFT, 80}, {KEY_DOWN, 81}, {KEY_UP, 82}, {KEY_NUMLOCK, 83},
-        {KEY_KPSLASH, 84}, {KEY_KPASTERISK, 85}, {KEY_KPMINUS, 86},
-        {KEY_KPPLUS, 87}, {KEY_KPENTER, 88}, {KEY_KP1, 89}, {KEY_KP2, 90},
-        {KEY_KP3, 91}, {KEY_KP4, 92}, {KEY_KP5, 93}, {KEY_KP6, 94},
-        {KEY_KP7, 95}, {KEY_KP8, 96}, {KEY_KP9, 97}, {KEY_KP0, 98},
-        {KEY_KPDOT, 99}
-    };
-    auto it = key_map.find(code);
-    if (it != key_map.end()) {
-        return it->second;
-    }
-    return 0;
+const transport_t transport_l2cap = { "l2cap", true, l2cap_open_listeners, l2cap_accept_channel, l2cap_connect_channel };
+
+sdp_session_t *sdp_session = nullptr;
+
+void usage(const char *prog) {
+    std::cerr << "Usage: " << prog << " [options]\n"
+              << "  -r, --rate HZ     mouse report rate: 125, 250, 500 or 1000 (default "
+              << REPORT_RATE_DEFAULT << ")\n"
+              << "      --immediate   send motion on every SYN_REPORT instead of on a timer\n"
+              << "      --hires       16-bit mouse axes, horizontal and high resolution wheel\n"
+              << "      --nkro        n-key rollover keyboard report instead of 6 keys\n"
+              << "  -t, --transport T l2cap (default) or unix:PATH for a local loopback link\n"
+              << "      --host PATH   run as the reference host for a unix:PATH emulator\n"
+              << "      --boot        with --host, switch the emulator to the boot protocol\n"
+              << "      --trace       record input-to-send latency, dumped on SIGUSR1 and at exit\n"
+              << "      --record FILE write the raw input events of all grabbed devices to FILE\n"
+              << "      --replay FILE feed a recorded capture instead of grabbing devices\n"
+              << "      --replay-fast replay as fast as possible instead of in real time\n"
+              << "      --threaded    read devices on a separate capture thread\n"
+              << "      --rt-prio N   run the threads SCHED_FIFO at priority N\n"
+              << "      --capture-cpu N, --sender-cpu N  pin the capture/sending thread to a CPU\n"
+              << "      --mlock       lock all memory to avoid page faults on the hot path\n"
+              << "      --reconnect-window S  keep a dropped host's session S seconds for it\n"
+              << "                    to come back, reconnecting to it (default "
+              << RECONNECT_WINDOW_DEFAULT << ", 0 = off)\n"
+              << "      --pointer [MATCH=]SENS[,ACCEL[,THRESHOLD]]  pointer sensitivity and\n"
+              << "                    acceleration, for devices whose name contains MATCH\n"
+              << "                    or for all others (default 1,0,"
+              << POINTER_THRESHOLD_DEFAULT << ")\n"
+              << "      --metrics PATH serve Prometheus metrics on the unix socket PATH\n"
+              << "      --gamepad     add a gamepad and forward game controllers to it\n"
+              << "      --deadzone PCT  stick dead zone in percent instead of the device's own\n"
+              << "      --io-uring    read devices and send reports through io_uring\n"
+              << "      --bench       time synthetic input through the report pipeline\n"
+              << "      --keymap FILE remap keys, layers, tap-hold keys and macros from FILE\n"
+              << "      --switch-key K  key that moves input to the next connected host\n"
+              << "                    (default SCROLLLOCK, none = off)\n"
+              << "  -h, --help        show this help" << std::endl;
 }
 
-void process_one_event(struct input_event *inevent) {
-    hidrep_keyb_t evkeyb;
-    int j;
-
-    switch (inevent->type) {
-        case EV_KEY: {
-            unsigned int u = 1;
-            switch (inevent->code) {
-                case BTN_LEFT:
-                case BTN_RIGHT:
-                case BTN_MIDDLE: {
-                    char c = 1 << (inevent->code & 0x03);
-                    mousebuttons &= (0x07 - c); 
-                    if (inevent->value == 1) mousebuttons |= c;
-
-                    // --- ADD THIS BLOCK ---
-                    // Send a mouse report immediately to register the click.
-                    // This report has the new button state but zero movement.
-                    hidrep_mouse_t evmouse;
-                    evmouse.btcode = 0xA1;
-                    evmouse.rep_id = REPORTID_MOUSE;
-                    evmouse.button = mousebuttons & 0x07;
-                    evmouse.axis_x = 0;
-                    evmouse.axis_y = 0;
-                    evmouse.axis_z = 0;
-                    if (send(int_conn, &evmouse, sizeof(evmouse), MSG_NOSIGNAL) < 0) {
-                        if (errno == EPIPE) {
-                            std::cerr << "Connection closed (EPIPE)." << std::endl;
-                        }
-                        keep_running = false;
-                    }
-                    // --- END OF ADDED BLOCK ---
-
-                    break;
+int main(int argc, char **argv) {
+    static const struct option long_opts[] = {
+        { "rate",      required_argument, nullptr, 'r' },
+        { "immediate", no_argument,       nullptr, 'i' },
+        { "hires",     no_argument,       nullptr, 'H' },
+        { "nkro",      no_argument,       nullptr, 'N' },
+        { "transport", required_argument, nullptr, 't' },
+        { "host",      required_argument, nullptr, 'C' },
+        { "boot",      no_argument,       nullptr, 'B' },
+        { "trace",     no_argument,       nullptr, 'T' },
+        { "record",    required_argument, nullptr, 'R' },
+        { "replay",    required_argument, nullptr, 'P' },
+        { "replay-fast", no_argument,     nullptr, 'F' },
+        { "threaded",  no_argument,       nullptr, 'M' },
+        { "rt-prio",   required_argument, nullptr, 'p' },
+        { "capture-cpu", required_argument, nullptr, 'c' },
+        { "sender-cpu", required_argument, nullptr, 's' },
+        { "mlock",     no_argument,       nullptr, 'L' },
+        { "reconnect-window", required_argument, nullptr, 'W' },
+        { "switch-key", required_argument, nullptr, 'K' },
+        { "pointer",   required_argument, nullptr, 'A' },
+        { "keymap",    required_argument, nullptr, 'Y' },
+        { "bench",     no_argument,       nullptr, 'U' },
+        { "metrics",   required_argument, nullptr, 'Q' },
+        { "gamepad",   no_argument,       nullptr, 'G' },
+        { "deadzone",  required_argument, nullptr, 'D' },
+        { "io-uring",  no_argument,       nullptr, 'I' },
+        { "help",      no_argument,       nullptr, 'h' },
+        { nullptr, 0, nullptr, 0 }
+    };
+    transport = &transport_l2cap;
+    const char *host_path = nullptr;
+    bool bench = false;
+    const char *record_path = nullptr, *replay_path = nullptr, *keymap_path = nullptr;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "r:t:h", long_opts, nullptr)) != -1) {
+        switch (opt) {
+            case 'r':
+                report_rate_hz = atoi(optarg);
+                if (report_rate_hz != 125 && report_rate_hz != 250 &&
+                    report_rate_hz != 500 && report_rate_hz != 1000) {
+                    std::cerr << "Unsupported report rate: " << optarg << std::endl;
+                    return 1;
                 }
-                case KEY_RIGHTMETA: u <<= 1;
-                case KEY_RIGHTALT: u <<= 1;
-                case KEY_RIGHTSHIFT: u <<= 1;
-                case KEY_RIGHTCTRL: u <<= 1;
-                case KEY_LEFTMETA: u <<= 1;
-                case KEY_LEFTALT: u <<= 1;
-                case KEY_LEFTSHIFT: u <<= 1;
-                case KEY_LEFTCTRL: {
-                    modifierkeys &= (0xff - u);
-                    if (inevent->value >= 1) modifierkeys |= u;
-                    evkeyb.btcode = 0xA1;
-                    evkeyb.rep_id = REPORTID_KEYBD;
-                    memcpy(evkeyb.key, pressedkey, 8);
-                    evkeyb.modify = modifierkeys;
-                    if (send(int_conn, &evkeyb, sizeof(evkeyb), MSG_NOSIGNAL) < 0) {
-                        if (errno == EPIPE) {
-                            std::cerr << "Connection closed (EPIPE)." << std::endl;
-                        }
-                        keep_running = false;
-                    }
-                    break;
+                break;
+            case 'i':
+                report_rate_hz = 0;
+                break;
+            case 'H':
+                mouse_hires = true;
+                break;
+            case 'N':
+                keyboard_nkro = true;
+                break;
+            case 't':
+                if (strcmp(optarg, "l2cap") == 0) {
+                    transport = &transport_l2cap;
+                } else if (strncmp(optarg, "unix:", 5) == 0 && optarg[5]) {
+                    transport = &transport_unix;
+                    unix_path = optarg + 5;
+                } else {
+                    std::cerr << "Unknown transport: " << optarg << std::endl;
+                    return 1;
                 }
-                default: {
-                    unsigned char hid_code = map_key_to_hid(inevent->code);
-                    if (hid_code != 0) {
-                        if (inevent->value == 1) { // Key Down
-                            for (j = 0; j < 8; ++j) if (pressedkey[j] == 0) { pressedkey[j] = hid_code; break; }
-                        } else if (inevent->value == 0) { // Key Up
-                            for (j = 0; j < 8; ++j) if (pressedkey[j] == hid_code) {
-                                for (int k = j; k < 7; ++k) pressedkey[k] = pressedkey[k+1];
-                                pressedkey[7] = 0;
-                                break;
-                            }
-                        }
-                    }
-                    
-                    evkeyb.btcode = 0xA1;
-                    evkeyb.rep_id = REPORTID_KEYBD;
-                    memcpy(evkeyb.key, pressedkey, 8);
-                    evkeyb.modify = modifierkeys;
-                    if (send(int_conn, &evkeyb, sizeof(evkeyb), MSG_NOSIGNAL) < 0) {
-                        if (errno == EPIPE) {
-                            std::cerr << "Connection closed (EPIPE)." << std::endl;
-                        }
-                        keep_running = false;
-                    }
-                    break;
+                break;
+            case 'C':
+                host_path = optarg;
+                break;
+            case 'B':
+                host_boot = true;
+                break;
+            case 'T':
+                trace_enabled = true;
+                break;
+            case 'R':
+                record_path = optarg;
+                break;
+            case 'P':
+                replay_path = optarg;
+                break;
+            case 'F':
+                replay_fast = true;
+                break;
+            case 'M':
+                threaded = true;
+                break;
+            case 'p':
+                rt_priority = atoi(optarg);
+                if (rt_priority < 1 || rt_priority > 99) {
+                    std::cerr << "SCHED_FIFO priority must be 1-99" << std::endl;
+                    return 1;
                 }
-            }
-            break;
-        }
-        case EV_REL: {
-            if (inevent->code == REL_X) dx += inevent->value;
-            if (inevent->code == REL_Y) dy += inevent->value;
-            if (inevent->code == REL_WHEEL) dz += inevent->value;
-            break;
-        }
-    }
-}
-
-void send_pending_reports(int int_sock) {
-    hidrep_mouse_t evmouse;
-    evmouse.btcode = 0xA1;
-    evmouse.rep_id = REPORTID_MOUSE;
-    evmouse.button = mousebuttons & 0x07;
-
-    // Loop to send multiple reports if accumulated movement is large
-    // Continue as long as there's significant movement remaining
-    while (abs(dx) >= 1.0 || abs(dy) >= 1.0 || abs(dz) >= 1.0) {
-        // Calculate the payload for this report, clamping to signed char limits
-        signed char report_payload_x = static_cast<signed char>(std::max(-127.0, std::min(127.0, floor(dx))));
-        signed char report_payload_y = static_cast<signed char>(std::max(-127.0, std::min(127.0, floor(dy))));
-        signed char report_payload_z = static_cast<signed char>(std::max(-127.0, std::min(127.0, floor(dz))));
-
-        // If all payloads are zero, but there's still accumulated movement,
-        // it means the remaining movement is sub-pixel and less than 0.5.
-        // In this case, we break to avoid an infinite loop.
-        if (report_payload_x == 0 && report_payload_y == 0 && report_payload_z == 0) {
-            break;
-        }
-
-        evmouse.axis_x = report_payload_x;
-        evmouse.axis_y = report_payload_y;
-        evmouse.axis_z = report_payload_z;
-
-        if (send(int_sock, &evmouse, sizeof(evmouse), MSG_NOSIGNAL) < 0) {
-            if (errno == EPIPE) {
-                std::cerr << "Connection closed (EPIPE)." << std::endl;
-            }
-            keep_running = false;
-            return; // Exit if send fails
+                break;
+            case 'c':
+                capture_cpu = atoi(optarg);
+                break;
+            case 's':
+                sender_cpu = atoi(optarg);
+                break;
+            case 'L':
+                lock_memory = true;
+                break;
+            case 'W':
+                reconnect_window = atoi(optarg);
+                if (reconnect_window < 0) {
+                    std::cerr << "Reconnect window must not be negative" << std::endl;
+                    return 1;
+                }
+                break;
+            case 'K':
+                switch_key = strcasecmp(optarg, "none") == 0 ? -1 : key_by_name(optarg);
+                if (switch_key < 0 && strcasecmp(optarg, "none") != 0) {
+                    std::cerr << "Unknown key: " << optarg << std::endl;
+                    return 1;
+                }
+                break;
+            case 'A':
+                if (!add_pointer_curve(optarg)) {
+                    std::cerr << "Bad pointer curve: " << optarg << std::endl;
+                    return 1;
+                }
+                break;
+            case 'Y':
+                keymap_path = optarg;
+                break;
+            case 'U':
+                bench = true;
+                break;
+            case 'Q':
+                metrics_path = optarg;
+                break;
+            case 'G':
+                gamepad = true;
+                break;
+            case 'D':
+                pad_deadzone_pct = atoi(optarg);
+                if (pad_deadzone_pct < 0 || pad_deadzone_pct > 90) {
+                    std::cerr << "Dead zone must be 0-90 percent" << std::endl;
+                    return 1;
+                }
+                break;
+            case 'I':
+                use_io_uring = true;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return 0;
+            default:
+                usage(argv[0]);
+                return 1;
         }
-
-        // Subtract the sent values from the accumulators
-        dx -= report_payload_x;
-        dy -= report_payload_y;
-        dz -= report_payload_z;
     }
-}
 
-int main() {
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
 
-    sdp_session = register_hid_service();
-    if (!sdp_session) {
-        std::cerr << "Failed to register SDP service. Is bluetoothd running?" << std::endl;
-        return 1;
+    if (host_path) {
+        return run_reference_host(host_path);
     }
 
-    ctl_sock = socket(AF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_L2CAP);
-    int_sock = socket(AF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_L2CAP);
-
-    if (ctl_sock < 0 || int_sock < 0) {
-        std::cerr << "Error creating sockets: " << strerror(errno) << std::endl;
+    if (!init_pipeline(record_path, replay_path, keymap_path)) {
         return 1;
     }
-
-    struct sockaddr_l2 addr = { 0 };
-    addr.l2_family = AF_BLUETOOTH;
-    addr.l2_psm = htobs(PSMHIDCTL);
-    bdaddr_t bdaddr_any = {0,0,0,0,0,0};
-    bacpy(&addr.l2_bdaddr, &bdaddr_any);
-
-    if (bind(ctl_sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-        std::cerr << "Error binding control socket: " << strerror(errno) << std::endl;
-        return 1;
+    if (bench) {
+        return run_benchmark();
     }
 
-    addr.l2_psm = htobs(PSMHIDINT);
-    if (bind(int_sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-        std::cerr << "Error binding interrupt socket: " << strerror(errno) << std::endl;
-        return 1;
-    }
-
-    if (listen(ctl_sock, 1) < 0 || listen(int_sock, 1) < 0) {
-        std::cerr << "Error listening on sockets: " << strerror(errno) << std::endl;
-        return 1;
-    }
-    std::cout << "Waiting for connections..." << std::endl;
-
-    auto last_report_time = steady_clock::now();
-    const milliseconds report_interval(1); // For 1000Hz
-
-    while (keep_running) {
-        struct sockaddr_l2 rem_addr = { 0 };
-        socklen_t opt = sizeof(rem_addr);
-
-        ctl_conn = accept(ctl_sock, (struct sockaddr *)&rem_addr, &opt);
-        if (ctl_conn < 0) { if (errno == EINTR || !keep_running) break; continue; }
-
-        char addr_str[18];
-        ba2str(&rem_addr.l2_bdaddr, addr_str);
-        std::cout << "Control connection accepted from " << addr_str << std::endl;
-
-        int_conn = accept(int_sock, (struct sockaddr *)&rem_addr, &opt);
-        if (int_conn < 0) { close(ctl_conn); ctl_conn = -1; continue; }
-        std::cout << "Interrupt connection accepted from " << addr_str << std::endl;
-        
-        if (init_event_devices() <= 0) {
-            std::cerr << "Could not grab any input devices. Closing connection." << std::endl;
-            close(ctl_conn);
-            close(int_conn);
-            ctl_conn = -1;
-            int_conn = -1;
-            continue;
+    hid_descriptor = build_hid_descriptor();
+    if (transport->needs_sdp) {
+        sdp_session = register_hid_service();
+        if (!sdp_session) {
+            std::cerr << "Failed to register SDP service. Is bluetoothd running?" << std::endl;
+            return 1;
         }
-
-        std::cout << "\nSuccessfully connected! Forwarding inputs..." << std::endl;
-
-        // Main event loop
-        while (keep_running) {
-            struct pollfd fds[event_fds.size() + 2];
-            for(size_t i = 0; i < event_fds.size(); ++i) {
-                fds[i].fd = event_fds[i];
-                fds[i].events = POLLIN;
-            }
-            fds[event_fds.size()].fd = ctl_conn;
-            fds[event_fds.size()].events = POLLIN;
-            fds[event_fds.size() + 1].fd = int_conn;
-            fds[event_fds.size() + 1].events = POLLIN;
-
-            int ret = poll(fds, event_fds.size() + 2, 1); // Reduced timeout for smoother mouse
-            if (ret < 0) { if (errno == EINTR) continue; break; }
-
-            for (size_t i = 0; i < event_fds.size(); ++i) {
-                if (fds[i].revents & POLLIN) {
-                    struct input_event inevent;
-                    if (read(fds[i].fd, &inevent, sizeof(inevent)) > 0) {
-                        process_one_event(&inevent);
-                    }
-                }
-            }
-
-            
-
-            if (fds[event_fds.size()].revents & (POLLHUP | POLLERR) || fds[event_fds.size() + 1].revents & (POLLHUP | POLLERR)) {
-                std::cout << "Connection lost." << std::endl;
-                break;
-            }
-
-            // NEW: Timer-based report sending logic
-            auto current_time = steady_clock::now();
-            if (duration_cast<milliseconds>(current_time - last_report_time) >= report_interval) {
-                send_pending_reports(int_conn);
-                last_report_time = current_time;
-            }
-        }
-
-        close_event_devices();
-        if (ctl_conn >= 0) close(ctl_conn);
-        if (int_conn >= 0) close(int_conn);
-        ctl_conn = -1;
-        int_conn = -1;
-        std::cout << "Connection closed. Waiting for new connection..." << std::endl;
     }
 
-    std::cout << "\nClosing listening sockets and cleaning up." << std::endl;
-    if (ctl_sock >= 0) close(ctl_sock);
-    if (int_sock >= 0) close(int_sock);
+    int ret = run_emulator();
     if (sdp_session) sdp_close(sdp_session);
-
-    return 0;
+    return ret;
 }
@@ -0,0 +1,221 @@
+#include "bthid.h"
+
+// --bench: pushes synthetic input streams through process_one_event and
+// the report encoder into a loopback socket and prints the throughput.
+// Motion is sent per frame, as with --immediate. The flags that shape the
+// reports (--nkro, --hires, --pointer, --keymap) apply.
+enum bench_kind_t { BENCH_KEYBOARD, BENCH_MOUSE, BENCH_MIXED };
+
+void bench_push(std::vector<struct input_event>& v, int type, int code, int value) {
+    struct input_event ev = {};
+    ev.type = type;
+    ev.code = code;
+    ev.value = value;
+    v.push_back(ev);
+}
+
+// Typing: a letter down, then up, with Shift on every eighth letter.
+// Mouse: a back and forth flick with a click every 64 frames and a wheel
+// step every 16. Mixed: one typing frame to four mouse frames.
+std::vector<struct input_event> bench_stream(bench_kind_t kind) {
+    static const int letters[] = { KEY_Q, KEY_W, KEY_E, KEY_R, KEY_T, KEY_Y, KEY_A, KEY_S,
+                                   KEY_D, KEY_F, KEY_G, KEY_H, KEY_Z, KEY_X, KEY_C, KEY_V };
+    std::vector<struct input_event> v;
+    int key_frame = 0, mouse_frame = 0;
+    for (int i = 0; i < BENCH_FRAMES; ++i) {
+        bool typing = kind == BENCH_KEYBOARD || (kind == BENCH_MIXED && i % 5 == 0);
+        if (typing) {
+            int n = key_frame++;
+            int down = !(n & 1);
+            if ((n / 2) % 8 == 0) bench_push(v, EV_KEY, KEY_LEFTSHIFT, down);
+            bench_push(v, EV_KEY, letters[(n / 2) % 16], down);
+        } else {
+            int n = mouse_frame++;
+            int swing = (n / 50) % 2 ? -1 : 1;
+            bench_push(v, EV_REL, REL_X, swing * (1 + n % 37));
+            bench_push(v, EV_REL, REL_Y, swing * (n % 23 - 11));
+            if (n % 16 == 0) bench_push(v, EV_REL, REL_WHEEL, swing);
+            if (n % 64 == 0) bench_push(v, EV_KEY, BTN_LEFT, 1);
+            if (n % 64 == 1) bench_push(v, EV_KEY, BTN_LEFT, 0);
+        }
+        bench_push(v, EV_SYN, SYN_REPORT, 0);
+    }
+    return v;
+}
+
+// map_key_to_hid against the std::map lookup it replaced, built from the
+// same keymap list and fed the same keys in a scrambled order, so neither
+// side gets a predictable access pattern
+void bench_key_lookups() {
+    std::map<int, unsigned char> tree;
+    std::vector<int> codes;
+    for (const keymap_entry_t& entry : keymap) {
+        if (entry.page != PAGE_KEYBD) continue;
+        tree[entry.code] = entry.usage;
+        codes.push_back(entry.code);
+    }
+    int keys[4096];
+    uint32_t seed = 1;
+    for (int& key : keys) {
+        seed = seed * 1103515245 + 12345;
+        key = codes[(seed >> 16) % codes.size()];
+    }
+
+    volatile unsigned sink = 0;
+    uint64_t start = monotonic_ns();
+    for (int i = 0; i < BENCH_LOOKUPS; ++i) sink = sink + map_key_to_hid(keys[i & 4095]);
+    uint64_t table_ns = monotonic_ns() - start;
+    start = monotonic_ns();
+    for (int i = 0; i < BENCH_LOOKUPS; ++i) {
+        auto it = tree.find(keys[i & 4095]);
+        sink = sink + (it != tree.end() ? it->second : 0);
+    }
+    uint64_t tree_ns = monotonic_ns() - start;
+
+    char line[128];
+    snprintf(line, sizeof(line), "  keycode lookup: table %.2f ns, std::map %.2f ns (%.1fx)",
+             (double)table_ns / BENCH_LOOKUPS, (double)tree_ns / BENCH_LOOKUPS, (double)tree_ns / table_ns);
+    std::cout << line << std::endl;
+}
+
+// Pointer frames through an accelerating curve with no host to send to,
+// so only the curve is timed: slow frames under its threshold against fast
+// ones far past it. Then the same frames through the gain table alone and
+// through the curve worked out in doubles per frame, floor()ed the way
+// motion was before the tables.
+void bench_pointer_curves() {
+    static pointer_curve_t curve = { "", 1.0, 0.25, POINTER_THRESHOLD_DEFAULT, {} };
+    build_pointer_curve(&curve);
+    int moves[2][4096];
+    uint32_t seed = 1;
+    for (int i = 0; i < 4096; ++i) {
+        seed = seed * 1103515245 + 12345;
+        int sign = (seed >> 31) ? -1 : 1;
+        moves[0][i] = sign * (1 + (seed >> 16) % 3);
+        moves[1][i] = sign * (40 + (seed >> 16) % 200);
+    }
+
+    host_session_t *saved_focus = focus;
+    const pointer_curve_t *saved_curve = device_curves[0];
+    focus = nullptr;
+    device_curves[0] = &curve;
+    uint64_t frame_ns[2];
+    for (int k = 0; k < 2; ++k) {
+        uint64_t start = monotonic_ns();
+        for (int i = 0; i < BENCH_POINTER_FRAMES; ++i) {
+            struct input_event ev = {};
+            ev.type = EV_REL;
+            ev.code = REL_X;
+            ev.value = moves[k][i & 4095];
+            process_one_event(&ev, 0);
+            ev.code = REL_Y;
+            ev.value = moves[k][(i + 7) & 4095];
+            process_one_event(&ev, 0);
+            ev.type = EV_SYN;
+            ev.code = SYN_REPORT;
+            ev.value = 0;
+            process_one_event(&ev, 0);
+        }
+        frame_ns[k] = monotonic_ns() - start;
+    }
+    device_curves[0] = saved_curve;
+    focus = saved_focus;
+
+    volatile int64_t sink = 0;
+    int64_t acc = 0;
+    uint64_t start = monotonic_ns();
+    for (int i = 0; i < BENCH_POINTER_FRAMES; ++i) {
+        int rx = moves[i & 1][i & 4095];
+        int speed = abs(rx);
+        acc += rx * (int64_t)curve.gain[std::min(speed, POINTER_LUT_SIZE - 1)];
+        sink = sink + (acc >> POINTER_FRAC_BITS);
+        acc -= (acc >> POINTER_FRAC_BITS) << POINTER_FRAC_BITS;
+    }
+    uint64_t table_ns = monotonic_ns() - start;
+    double facc = 0.0;
+    start = monotonic_ns();
+    for (int i = 0; i < BENCH_POINTER_FRAMES; ++i) {
+        int rx = moves[i & 1][i & 4095];
+        int speed = abs(rx);
+        double gain = curve.sensitivity * (1.0 + curve.accel * std::max(0, speed - curve.threshold));
+        facc += rx * std::min(gain, (double)POINTER_GAIN_MAX);
+        double whole = floor(facc);
+        sink = sink + (int64_t)whole;
+        facc -= whole;
+    }
+    uint64_t double_ns = monotonic_ns() - start;
+
+    char line[128];
+    snprintf(line, sizeof(line), "  pointer frame: slow %.2f ns, fast %.2f ns",
+             (double)frame_ns[0] / BENCH_POINTER_FRAMES, (double)frame_ns[1] / BENCH_POINTER_FRAMES);
+    std::cout << line << std::endl;
+    snprintf(line, sizeof(line), "  pointer curve: table %.2f ns, double %.2f ns (%.1fx)",
+             (double)table_ns / BENCH_POINTER_FRAMES, (double)double_ns / BENCH_POINTER_FRAMES, (double)double_ns / table_ns);
+    std::cout << line << std::endl;
+}
+
+int run_benchmark() {
+    report_rate_hz = 0;
+    int ctl[2], intr[2];
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0 || socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, ctl) < 0 ||
+        socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, intr) < 0) {
+        std::cerr << "Error setting up the benchmark link: " << strerror(errno) << std::endl;
+        return 1;
+    }
+    hid_descriptor = build_hid_descriptor();
+    host_session_t *s = add_session("benchmark");
+    activate_session(s, ctl[0], intr[0]);
+    focus = s;
+    // Room for a whole batch, so the run measures the pipeline, not congestion
+    int bufsize = 1 << 20;
+    setsockopt(intr[0], SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+    setsockopt(intr[1], SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+
+    static const struct { const char *name; bench_kind_t kind; } runs[] = {
+        { "keyboard", BENCH_KEYBOARD }, { "mouse", BENCH_MOUSE }, { "mixed", BENCH_MIXED },
+    };
+    char line[128];
+    std::cout << "  stream       events   reports   events/s  reports/s  ns/event  syscalls/report" << std::endl;
+    for (const auto& run : runs) {
+        std::vector<struct input_event> events = bench_stream(run.kind);
+        clear_input_state();
+        reset_report_history(s);
+        uint64_t sent = report_stats.sent, calls = report_stats.send_calls, busy_ns = 0;
+
+        // Batches of a device read, with the loopback host catching up in between
+        for (size_t i = 0; i < events.size(); i += EVENT_BATCH) {
+            size_t end = std::min(events.size(), i + EVENT_BATCH);
+            uint64_t start = monotonic_ns();
+            for (size_t j = i; j < end; ++j) process_one_event(&events[j], 0);
+            uring_settle();
+            busy_ns += monotonic_ns() - start;
+
+            unsigned char rep[64];
+            while (recv(intr[1], rep, sizeof(rep), MSG_DONTWAIT) > 0) {}
+            if (!s->send_queue.empty()) drain_send_queue(s);
+        }
+
+        sent = report_stats.sent - sent;
+        calls = report_stats.send_calls - calls;
+        double secs = busy_ns / 1e9;
+        snprintf(line, sizeof(line), "  %-9s %9zu %9lu %10.0f %10.0f %9.1f %16.3f", run.name, events.size(),
+                 (unsigned long)sent, events.size() / secs, sent / secs, (double)busy_ns / events.size(),
+                 sent ? (double)calls / sent : 0.0);
+        std::cout << line << std::endl;
+    }
+
+    bench_key_lookups();
+    bench_pointer_curves();
+    if (metrics.stalls.load()) print_report_stats();
+
+    sessions.clear();
+    focus = nullptr;
+    uring_stop();
+    close(ctl[0]);
+    close(ctl[1]);
+    close(intr[0]);
+    close(intr[1]);
+    close(epoll_fd);
+    return 0;
+}
@@ -0,0 +1,1119 @@
+// Input side of the core: event loop registration, device grabbing and
+// hotplug, SYN_DROPPED resync, capture files and replay, the threaded
+// capture ring and the io_uring engine.
+#include "bthid.h"
+
+int epoll_fd = -1;
+int device_epoll_fd = -1;	// evdev fds live here: epoll_fd, or the capture thread's own
+std::list<event_device_t> event_devices; // list: handlers need stable addresses
+
+// Latency tracing (--trace)
+bool trace_enabled = false;
+volatile sig_atomic_t trace_dump_requested = 0;
+std::vector<trace_record_t> trace_ring;
+uint64_t trace_head = 0;
+uint64_t trace_read_ns = 0;		// read time of the batch being processed
+trace_record_t trace_pending = {};	// oldest input waiting for the next report
+
+void trace_signal_handler(int signum) {
+    trace_dump_requested = 1;
+}
+
+void dump_trace() {
+    static const char *stage_names[] = { "read", "process", "schedule", "send", "total" };
+    std::vector<uint64_t> stages[5];
+
+    uint64_t count = std::min<uint64_t>(trace_head, TRACE_RING_SIZE);
+    for (uint64_t i = 0; i < count; ++i) {
+        const trace_record_t& rec = trace_ring[i];
+        // Skip events stamped before the device clock was switched
+        if (rec.t[TP_READ] < rec.t[TP_KERNEL]) continue;
+        if (!rec.is_report) {
+            stages[0].push_back(rec.t[TP_READ] - rec.t[TP_KERNEL]);
+            continue;
+        }
+        stages[1].push_back(rec.t[TP_PROCESSED] - rec.t[TP_READ]);
+        stages[2].push_back(rec.t[TP_SEND_START] - rec.t[TP_PROCESSED]);
+        stages[3].push_back(rec.t[TP_SEND_END] - rec.t[TP_SEND_START]);
+        stages[4].push_back(rec.t[TP_SEND_END] - rec.t[TP_KERNEL]);
+    }
+
+    char line[128];
+    std::cout << "Latency over the last " << count << " trace records (us):\n"
+              << "  stage         count      p50      p99     p999      max" << std::endl;
+    for (int i = 0; i < 5; ++i) {
+        std::vector<uint64_t>& v = stages[i];
+        if (v.empty()) continue;
+        std::sort(v.begin(), v.end());
+        auto pct = [&v](double p) { return v[std::min(v.size() - 1, (size_t)(p * v.size()))] / 1000.0; };
+        snprintf(line, sizeof(line), "  %-9s %9zu %8.1f %8.1f %8.1f %8.1f", stage_names[i], v.size(),
+                 pct(0.50), pct(0.99), pct(0.999), v.back() / 1000.0);
+        std::cout << line << std::endl;
+    }
+}
+
+bool watch_fd(fd_handler_t *handler, uint32_t events, int epfd) {
+    struct epoll_event ev = {};
+    ev.events = events;
+    ev.data.ptr = handler;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, handler->fd, &ev) < 0) {
+        std::cerr << "epoll_ctl ADD failed for fd " << handler->fd << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Changes the events an already watched handler waits for
+void watch_fd_events(fd_handler_t *handler, uint32_t events, int epfd) {
+    struct epoll_event ev = {};
+    ev.events = events;
+    ev.data.ptr = handler;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, handler->fd, &ev);
+}
+
+void unwatch_fd(int fd, int epfd) {
+    if (fd >= 0) epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+// io_uring engine (--io-uring, compiled in with -DWITH_IO_URING). The main
+// loop sleeps in io_uring_enter() instead of epoll_wait(): every grabbed
+// device keeps a batched read posted, epoll_fd itself is one poll request so
+// all other handlers run unchanged, and the reports of a loop turn go out as
+// send requests in the same io_uring_enter() that waits for the next input.
+// A report then costs one syscall instead of a wakeup, a read and a send.
+// Only the kernel header is needed, not liburing. Without it, or when the
+// kernel refuses io_uring, the epoll loop runs as before.
+bool use_io_uring = false;
+
+#ifdef WITH_IO_URING
+#define	URING_ENTRIES	256
+#define	URING_SENDS	64	// report buffers, waiting for the next submit or in flight
+
+// The user_data of every SQE points at the uring_op_t its owner starts with
+enum uring_op_t { URING_POLL, URING_READ, URING_SEND, URING_CANCEL };
+
+struct uring_read_t {
+	uring_op_t	op;
+	event_device_t	*dev;		// null once the device is released
+	struct input_event	buf[EVENT_BATCH];
+};
+
+struct uring_t {
+	int		fd;
+	unsigned	*sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned	*cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe	*sqes;
+	struct io_uring_cqe	*cqes;
+	unsigned	sq_local_tail;	// SQEs written, published by the next enter
+	void		*sq_ring, *cq_ring, *sqe_map;
+	size_t		sq_ring_len, cq_ring_len, sqe_map_len;
+};
+uring_t uring = { -1 };
+uring_op_t uring_poll_op = URING_POLL, uring_cancel_op = URING_CANCEL;
+
+bool uring_active() {
+    return uring.fd >= 0;
+}
+
+void uring_stop() {
+    if (uring.sq_ring && uring.sq_ring != MAP_FAILED) munmap(uring.sq_ring, uring.sq_ring_len);
+    if (uring.cq_ring && uring.cq_ring != MAP_FAILED) munmap(uring.cq_ring, uring.cq_ring_len);
+    if (uring.sqe_map && uring.sqe_map != MAP_FAILED) munmap(uring.sqe_map, uring.sqe_map_len);
+    if (uring.fd >= 0) close(uring.fd);
+    uring = { -1 };
+}
+
+// Sets the ring up; false leaves the epoll loop in charge
+bool uring_start() {
+    struct io_uring_params p = {};
+    int fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (fd < 0) {
+        std::cerr << "io_uring unavailable (" << strerror(errno) << "), using epoll." << std::endl;
+        return false;
+    }
+    // Without fast poll a read waiting on a device ties up a kernel worker
+    if (!(p.features & IORING_FEAT_FAST_POLL)) {
+        std::cerr << "Kernel io_uring too old, using epoll." << std::endl;
+        close(fd);
+        return false;
+    }
+
+    uring.fd = fd;
+    uring.sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    uring.cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    uring.sqe_map_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    uring.sq_ring = mmap(nullptr, uring.sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    uring.cq_ring = mmap(nullptr, uring.cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    uring.sqe_map = mmap(nullptr, uring.sqe_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (uring.sq_ring == MAP_FAILED || uring.cq_ring == MAP_FAILED || uring.sqe_map == MAP_FAILED) {
+        std::cerr << "Could not map the io_uring rings: " << strerror(errno) << ", using epoll." << std::endl;
+        uring_stop();
+        return false;
+    }
+
+    char *sq = static_cast<char *>(uring.sq_ring), *cq = static_cast<char *>(uring.cq_ring);
+    uring.sq_head = reinterpret_cast<unsigned *>(sq + p.sq_off.head);
+    uring.sq_tail = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+    uring.sq_mask = reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+    uring.sq_array = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+    uring.cq_head = reinterpret_cast<unsigned *>(cq + p.cq_off.head);
+    uring.cq_tail = reinterpret_cast<unsigned *>(cq + p.cq_off.tail);
+    uring.cq_mask = reinterpret_cast<unsigned *>(cq + p.cq_off.ring_mask);
+    uring.sqes = static_cast<struct io_uring_sqe *>(uring.sqe_map);
+    uring.cqes = reinterpret_cast<struct io_uring_cqe *>(cq + p.cq_off.cqes);
+    uring.sq_local_tail = *uring.sq_tail;
+    std::cout << "Using io_uring for device reads and report sends." << std::endl;
+    return true;
+}
+
+// Publishes the SQEs written so far and, with min_complete, sleeps until
+// that many completions are waiting
+int uring_enter(unsigned min_complete) {
+    __atomic_store_n(uring.sq_tail, uring.sq_local_tail, __ATOMIC_RELEASE);
+    unsigned submit = uring.sq_local_tail - __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE);
+    return syscall(__NR_io_uring_enter, uring.fd, submit, min_complete,
+                   min_complete ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+}
+
+inline unsigned uring_sq_space() {
+    return *uring.sq_mask + 1 - (uring.sq_local_tail - __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE));
+}
+
+struct io_uring_sqe *uring_sqe(uring_op_t *owner) {
+    if (!uring_sq_space()) uring_enter(0);
+    unsigned idx = uring.sq_local_tail++ & *uring.sq_mask;
+    struct io_uring_sqe *sqe = &uring.sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = reinterpret_cast<uintptr_t>(owner);
+    uring.sq_array[idx] = idx;
+    return sqe;
+}
+
+void uring_post_read(uring_read_t *r) {
+    struct io_uring_sqe *sqe = uring_sqe(&r->op);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = r->dev->fd;
+    sqe->addr = reinterpret_cast<uintptr_t>(r->buf);
+    sqe->len = sizeof(r->buf);
+}
+
+// Devices the main thread reads go through the ring. The fd has to block:
+// on an O_NONBLOCK fd io_uring returns EAGAIN instead of waiting for input.
+bool uring_watch_device(event_device_t& dev) {
+    if (!uring_active() || device_epoll_fd != epoll_fd) return false;
+    fcntl(dev.fd, F_SETFL, fcntl(dev.fd, F_GETFL) & ~O_NONBLOCK);
+    dev.uring_read = new uring_read_t{URING_READ, &dev, {}};
+    uring_post_read(dev.uring_read);
+    return true;
+}
+
+// The read may still be posted: it is cancelled, and its completion frees it
+void uring_unwatch_device(event_device_t& dev) {
+    uring_read_t *r = dev.uring_read;
+    if (!r) return;
+    r->dev = nullptr;
+    dev.uring_read = nullptr;
+    struct io_uring_sqe *sqe = uring_sqe(&uring_cancel_op);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = reinterpret_cast<uintptr_t>(&r->op);
+}
+
+#endif
+
+// Device manager. /dev/input is watched with inotify for the life of the
+// process; while a host is connected every matching node is grabbed as soon
+// as it shows up, and released devices simply fail their next read. What a
+// node is gets probed once from its capability bits and cached by path,
+// so nodes we do not want are never opened again.
+#define	INPUT_DIR	"/dev/input/"
+
+struct device_caps_t {
+	ino_t		ino;		// node identity, a recreated node is probed again
+	time_t		ctime;
+	bool		wanted;
+	std::string	kind;		// "keyboard", "mouse", ...
+};
+
+std::map<std::string, device_caps_t> device_cache;
+int inotify_fd = -1;
+fd_handler_t inotify_handler;
+bool grabbing = false;		// a host is connected, grab what appears
+// Device slots (event_device_t::index) not held by a grabbed device. Slots
+// index the per-device tables, so one is reused only once its device is
+// released, the longest free first; with all 256 taken a device is refused.
+std::deque<uint8_t> free_device_slots;
+
+inline bool test_bit(const unsigned long *bits, int bit) {
+    return bits[bit / (8 * sizeof(unsigned long))] & (1UL << (bit % (8 * sizeof(unsigned long))));
+}
+
+// Decides from the capability bits whether a node is something we forward
+void probe_device(int fd, device_caps_t *caps) {
+    unsigned long evbits[EV_MAX / (8 * sizeof(unsigned long)) + 1] = { 0 };
+    unsigned long keybits[KEY_MAX / (8 * sizeof(unsigned long)) + 1] = { 0 };
+    unsigned long relbits[REL_MAX / (8 * sizeof(unsigned long)) + 1] = { 0 };
+
+    ioctl(fd, EVIOCGBIT(0, sizeof(evbits)), evbits);
+    if (test_bit(evbits, EV_KEY)) ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(keybits)), keybits);
+    if (test_bit(evbits, EV_REL)) ioctl(fd, EVIOCGBIT(EV_REL, sizeof(relbits)), relbits);
+
+    caps->wanted = true;
+    if (test_bit(evbits, EV_REL) && test_bit(relbits, REL_X) && test_bit(relbits, REL_Y) &&
+        test_bit(keybits, BTN_LEFT)) {
+        caps->kind = "mouse";
+    } else if (gamepad && test_bit(evbits, EV_ABS) && test_bit(keybits, BTN_GAMEPAD)) {
+        caps->kind = "gamepad";
+    } else if (test_bit(keybits, KEY_A) && test_bit(keybits, KEY_Z) && test_bit(keybits, KEY_SPACE)) {
+        caps->kind = "keyboard";
+    } else if (test_bit(keybits, KEY_PLAYPAUSE) || test_bit(keybits, KEY_NEXTSONG)) {
+        // Media key nodes of keyboards, but not power buttons or lid switches
+        caps->kind = "media keys";
+    } else {
+        caps->wanted = false;
+    }
+}
+
+bool device_is_grabbed(const std::string& path) {
+    for (const event_device_t& dev : event_devices) {
+        if (dev.path == path) return true;
+    }
+    return false;
+}
+
+void on_event_device(fd_handler_t *handler, uint32_t events);
+void publish_device_setup(uint8_t index);
+
+// Curve and pad calibration of a newly grabbed device. device_curves and
+// pad_calibs are only touched by the thread that encodes reports: with
+// --threaded a device grabbed on the capture thread stages its tables here
+// and sends the slot through the ring ahead of its first event.
+struct device_setup_t {
+	const pointer_curve_t	*curve;
+	pad_calib_t		pad;
+};
+device_setup_t device_setups[256];
+
+void apply_device_setup(uint8_t index) {
+    device_curves[index] = device_setups[index].curve;
+    pad_calibs[index] = device_setups[index].pad;
+}
+
+// Keyboard LEDs as the host last set them. The HIDP handler stores them and
+// pokes led_event_fd, and whichever thread owns the device list writes them
+// to every grabbed device; the kernel drops them for devices without LEDs.
+std::atomic<unsigned char> host_leds{0};
+int led_event_fd = -1;
+fd_handler_t led_handler;
+
+void write_leds(int fd, unsigned char leds) {
+    struct input_event ev[LED_KANA + 2] = {};
+    for (int led = LED_NUML; led <= LED_KANA; ++led) {
+        ev[led].type = EV_LED;
+        ev[led].code = led;
+        ev[led].value = (leds >> led) & 1; // HID LED usages 1-5 are bits 0-4
+    }
+    ev[LED_KANA + 1].type = EV_SYN;
+    ev[LED_KANA + 1].code = SYN_REPORT;
+    write(fd, ev, sizeof(ev)); // Fails on nodes we could only open read-only
+}
+
+void on_led_event(fd_handler_t *handler, uint32_t events) {
+    uint64_t count;
+    if (read(handler->fd, &count, sizeof(count)) < 0) return;
+    for (const event_device_t& dev : event_devices) write_leds(dev.fd, host_leds);
+}
+
+void set_host_leds(unsigned char leds) {
+    host_leds = leds;
+    uint64_t one = 1;
+    if (led_event_fd >= 0) write(led_event_fd, &one, sizeof(one));
+}
+
+// Grabs `path` if it is a device we forward and not ours already
+void consider_device(const std::string& path) {
+    if (!grabbing || device_is_grabbed(path)) return;
+
+    struct stat st;
+    if (stat(path.c_str(), &st) < 0 || !S_ISCHR(st.st_mode)) return;
+
+    auto cached = device_cache.find(path);
+    bool fresh = cached != device_cache.end() &&
+                 cached->second.ino == st.st_ino && cached->second.ctime == st.st_ctime;
+    if (fresh && !cached->second.wanted) return;
+
+    // Writable so the host's LED state can be mirrored back
+    int fd = open(path.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) fd = open(path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) return; // udev may not have set permissions yet, IN_ATTRIB retries
+
+    if (!fresh) {
+        device_caps_t caps = { st.st_ino, st.st_ctime, false, "" };
+        probe_device(fd, &caps);
+        cached = device_cache.insert_or_assign(path, caps).first;
+        if (!caps.wanted) {
+            close(fd);
+            return;
+        }
+    }
+
+    if (free_device_slots.empty()) {
+        std::cerr << "Not grabbing " << path << ": all 256 device slots are in use." << std::endl;
+        close(fd);
+        return;
+    }
+    if (ioctl(fd, EVIOCGRAB, 1) < 0) {
+        std::cerr << "Could not grab device " << path << ". Are you root?" << std::endl;
+        close(fd);
+        return;
+    }
+    if (trace_enabled) {
+        int clk = CLOCK_MONOTONIC;
+        ioctl(fd, EVIOCSCLOCKID, &clk);
+    }
+
+    char name[256] = "Unknown";
+    ioctl(fd, EVIOCGNAME(sizeof(name)), name);
+    const pointer_curve_t *curve = pointer_curve_for(name, path);
+    uint8_t index = free_device_slots.front();
+    free_device_slots.pop_front();
+    device_setup_t& setup = device_setups[index];
+    setup.curve = curve;
+    if (cached->second.kind == "gamepad") calibrate_pad(fd, &setup.pad);
+    else default_pad_calib(&setup.pad);
+    publish_device_setup(index);
+
+    publish_device_metrics(metrics.devices[index], path);
+
+    event_devices.push_back({fd, path, index, false, {}});
+    event_device_t& dev = event_devices.back();
+    dev.handler = {fd, on_event_device, &dev};
+    // Through io_uring, or edge-triggered: drain_event_device always empties the buffer
+    if (!uring_watch_device(dev) && !watch_fd(&dev.handler, EPOLLIN | EPOLLET, device_epoll_fd)) {
+        ioctl(fd, EVIOCGRAB, 0);
+        close(fd);
+        event_devices.pop_back();
+        metrics.devices[index].grabbed.store(false, std::memory_order_relaxed);
+        free_device_slots.push_back(index);
+        return;
+    }
+
+    write_leds(fd, host_leds);
+
+    std::cout << "Grabbed device: " << path << " (" << name << ", " << cached->second.kind;
+    if (curve != &default_curve) std::cout << ", pointer curve \"" << curve->match << "\"";
+    std::cout << ")" << std::endl;
+}
+
+void on_inotify(fd_handler_t *handler, uint32_t events) {
+    alignas(struct inotify_event) char buf[4096];
+    ssize_t len;
+    while ((len = read(handler->fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + len; ) {
+            struct inotify_event *ev = reinterpret_cast<struct inotify_event *>(p);
+            p += sizeof(*ev) + ev->len;
+            if (!ev->len || strncmp(ev->name, "event", 5) != 0) continue;
+
+            std::string path = std::string(INPUT_DIR) + ev->name;
+            if (ev->mask & IN_DELETE) {
+                device_cache.erase(path);
+            } else {
+                consider_device(path);
+            }
+        }
+    }
+}
+
+bool start_device_manager() {
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0 || inotify_add_watch(inotify_fd, INPUT_DIR, IN_CREATE | IN_ATTRIB | IN_DELETE) < 0) {
+        std::cerr << "Could not watch " INPUT_DIR ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    inotify_handler = {inotify_fd, on_inotify, nullptr};
+
+    led_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (led_event_fd < 0) {
+        std::cerr << "Error creating LED eventfd: " << strerror(errno) << std::endl;
+        return false;
+    }
+    led_handler = {led_event_fd, on_led_event, nullptr};
+    return watch_fd(&inotify_handler, EPOLLIN, device_epoll_fd) &&
+           watch_fd(&led_handler, EPOLLIN, device_epoll_fd);
+}
+
+void close_event_devices() {
+    grabbing = false;
+    for (event_device_t& dev : event_devices) {
+        if (dev.fd >= 0) {
+            unwatch_fd(dev.fd, device_epoll_fd);
+            uring_unwatch_device(dev);
+            ioctl(dev.fd, EVIOCGRAB, 0); // Release grab
+            close(dev.fd);
+        }
+        metrics.devices[dev.index & 0xFF].grabbed.store(false, std::memory_order_relaxed);
+    }
+    event_devices.clear();
+    std::cout << "Released input devices." << std::endl;
+}
+
+// Starts grabbing: everything already present now, hotplugged nodes later
+int init_event_devices() {
+    grabbing = true;
+    free_device_slots.clear();
+    for (int i = 0; i < 256; ++i) free_device_slots.push_back(i);
+
+    DIR *dir = opendir(INPUT_DIR);
+    if (!dir) {
+        std::cerr << "Could not open " INPUT_DIR ". Is this a Linux system?" << std::endl;
+        return -1;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        if (strncmp(entry->d_name, "event", 5) == 0) {
+            consider_device(std::string(INPUT_DIR) + entry->d_name);
+        }
+    }
+    closedir(dir);
+
+    if (event_devices.empty()) {
+        std::cerr << "No suitable keyboard or mouse found in " INPUT_DIR << std::endl;
+        grabbing = false;
+        return -1;
+    }
+
+    return event_devices.size();
+}
+
+void deliver_event(struct input_event *ev, uint64_t read_ns, uint8_t device) {
+    if (trace_enabled) {
+        trace_read_ns = read_ns;
+        trace_event(ev);
+    }
+    process_one_event(ev, device);
+}
+
+FILE *record_file = nullptr;
+void record_events(const event_device_t& dev, const struct input_event *evs, size_t count);
+
+// Key state as the device's events left it, kept where they are read so a
+// resync can tell which edges went missing
+inline void note_key_event(event_device_t& dev, const struct input_event *ev) {
+    const size_t bits = 8 * sizeof(unsigned long);
+    if (ev->type != EV_KEY || ev->code >= KEY_CNT || (ev->value & ~KEY_RESYNC) > 1) return;
+    if (ev->value & 1) dev.keys_seen[ev->code / bits] |= 1UL << (ev->code % bits);
+    else dev.keys_seen[ev->code / bits] &= ~(1UL << (ev->code % bits));
+}
+
+// After SYN_DROPPED the key/button edges in the lost events are unknown, so
+// ask the kernel for the real state and emit the keys that differ from what
+// the events said as one synthetic frame. The edges carry KEY_RESYNC so
+// process_one_event applies them as state, never as remap actions.
+void resync_device_keys(event_device_t& dev, event_sink_t sink) {
+    unsigned long keycaps[KEY_MAX / (8 * sizeof(unsigned long)) + 1] = { 0 };
+    unsigned long keystate[KEY_MAX / (8 * sizeof(unsigned long)) + 1] = { 0 };
+    const size_t bits = 8 * sizeof(unsigned long);
+
+    if (ioctl(dev.fd, EVIOCGBIT(EV_KEY, sizeof(keycaps)), keycaps) < 0 ||
+        ioctl(dev.fd, EVIOCGKEY(sizeof(keystate)), keystate) < 0) {
+        return;
+    }
+
+    // The frame is recorded too: a replay has no kernel state to ask
+    uint64_t now = monotonic_ns();
+    struct input_event synth = {};
+    synth.input_event_sec = now / 1000000000ULL;
+    synth.input_event_usec = now % 1000000000ULL / 1000;
+    for (int code = 0; code < KEY_CNT; ++code) {
+        unsigned long bit = 1UL << (code % bits);
+        if (!(keycaps[code / bits] & bit)) continue;
+        if (!((keystate[code / bits] ^ dev.keys_seen[code / bits]) & bit)) continue;
+        synth.type = EV_KEY;
+        synth.code = code;
+        synth.value = KEY_RESYNC | ((keystate[code / bits] & bit) ? 1 : 0);
+        note_key_event(dev, &synth);
+        if (record_file) record_events(dev, &synth, 1);
+        sink(&synth, now, dev.index);
+    }
+    synth.type = EV_SYN;
+    synth.code = SYN_REPORT;
+    synth.value = 0;
+    if (record_file) record_events(dev, &synth, 1);
+    sink(&synth, now, dev.index);
+}
+
+// Capture files (--record / --replay), laid out as in bthid.h
+bool open_capture_for_record(const char *path) {
+    record_file = fopen(path, "wb");
+    if (!record_file) {
+        std::cerr << "Could not create capture " << path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    setvbuf(record_file, nullptr, _IOFBF, 1 << 16);
+
+    capture_header_t hdr = {};
+    memcpy(hdr.magic, CAPTURE_MAGIC, sizeof(hdr.magic));
+    hdr.version = CAPTURE_VERSION;
+    hdr.record_size = sizeof(capture_event_t);
+    fwrite(&hdr, sizeof(hdr), 1, record_file);
+    return true;
+}
+
+void record_events(const event_device_t& dev, const struct input_event *evs, size_t count) {
+    capture_event_t recs[EVENT_BATCH];
+    for (size_t i = 0; i < count; ++i) {
+        recs[i].time_ns = (uint64_t)evs[i].input_event_sec * 1000000000ULL + evs[i].input_event_usec * 1000ULL;
+        recs[i].value = evs[i].value;
+        recs[i].code = evs[i].code;
+        recs[i].type = evs[i].type;
+        recs[i].device = dev.index;
+    }
+    fwrite(recs, sizeof(capture_event_t), count, record_file);
+}
+
+// Replay feeds a capture through the same per-device handling as grabbed
+// devices, paced by the original timestamps or as fast as possible. A
+// SYN_DROPPED discards the rest of its frame as it did live, and the resync
+// frame recorded after it takes the place of the kernel's key state.
+void handle_device_events(event_device_t& dev, struct input_event *evbuf, size_t count, event_sink_t sink);
+
+const capture_event_t *replay_events = nullptr;
+event_device_t replay_devices[256];	// by capture_event_t::device, never opened
+size_t replay_count = 0, replay_pos = 0;
+size_t replay_map_len = 0;
+bool replay_fast = false;
+uint64_t replay_start_ns = 0;
+int replay_timer_fd = -1;
+fd_handler_t replay_handler;
+
+bool open_capture_for_replay(const char *path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        std::cerr << "Could not open capture " << path << ": " << strerror(errno) << std::endl;
+        if (fd >= 0) close(fd);
+        return false;
+    }
+
+    void *map = st.st_size ? mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    const capture_header_t *hdr = static_cast<const capture_header_t *>(map);
+    if (map == MAP_FAILED || (size_t)st.st_size < sizeof(*hdr) ||
+        memcmp(hdr->magic, CAPTURE_MAGIC, sizeof(hdr->magic)) != 0 ||
+        hdr->version != CAPTURE_VERSION || hdr->record_size != sizeof(capture_event_t)) {
+        std::cerr << "Not a usable capture file: " << path << std::endl;
+        if (map != MAP_FAILED) munmap(map, st.st_size);
+        return false;
+    }
+
+    replay_map_len = st.st_size;
+    replay_events = reinterpret_cast<const capture_event_t *>(hdr + 1);
+    replay_count = (st.st_size - sizeof(*hdr)) / sizeof(capture_event_t);
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    return true;
+}
+
+void arm_replay_timer() {
+    struct itimerspec its = {};
+    if (replay_fast) {
+        its.it_value.tv_nsec = 1; // As soon as the loop comes around
+        timerfd_settime(replay_timer_fd, 0, &its, nullptr);
+        return;
+    }
+    uint64_t due = replay_start_ns + (replay_events[replay_pos].time_ns - replay_events[0].time_ns);
+    its.it_value.tv_sec = due / 1000000000ULL;
+    its.it_value.tv_nsec = due % 1000000000ULL;
+    timerfd_settime(replay_timer_fd, TFD_TIMER_ABSTIME, &its, nullptr);
+}
+
+void on_replay_timer(fd_handler_t *handler, uint32_t events) {
+    uint64_t expirations;
+    if (read(handler->fd, &expirations, sizeof(expirations)) != sizeof(expirations)) return;
+
+    // Everything that is due, or a bounded slice when running flat out so
+    // the report timer and link still get serviced between slices
+    uint64_t now = monotonic_ns();
+    size_t slice_end = replay_fast ? std::min(replay_count, replay_pos + 4096) : replay_count;
+    while (replay_pos < slice_end && focus_up()) {
+        const capture_event_t& rec = replay_events[replay_pos];
+        if (!replay_fast && replay_start_ns + (rec.time_ns - replay_events[0].time_ns) > now) break;
+
+        struct input_event ev = {};
+        ev.input_event_sec = rec.time_ns / 1000000000ULL;
+        ev.input_event_usec = rec.time_ns % 1000000000ULL / 1000;
+        ev.type = rec.type;
+        ev.code = rec.code;
+        ev.value = rec.value;
+        handle_device_events(replay_devices[rec.device], &ev, 1, deliver_event);
+        replay_pos++;
+    }
+
+    if (replay_pos < replay_count) {
+        arm_replay_timer();
+    } else {
+        std::cout << "Replay finished: " << replay_count << " events." << std::endl;
+        send_pending_reports();
+        keep_running = false;
+    }
+}
+
+void start_replay() {
+    for (int i = 0; i < 256; ++i) {
+        replay_devices[i] = {};
+        replay_devices[i].fd = -1;
+        replay_devices[i].index = i;
+    }
+    replay_pos = 0;
+    replay_start_ns = monotonic_ns();
+    if (replay_count == 0) {
+        keep_running = false;
+        return;
+    }
+    arm_replay_timer();
+}
+
+// One read's worth of events from a device
+void handle_device_events(event_device_t& dev, struct input_event *evbuf, size_t count, event_sink_t sink) {
+    uint64_t read_ns = trace_enabled ? monotonic_ns() : 0;
+    size_t recorded = 0;
+    for (size_t i = 0; i < count; ++i) {
+        struct input_event *ev = &evbuf[i];
+        if (ev->type == EV_SYN && ev->code == SYN_DROPPED) {
+            dev.syn_dropped = true;
+            continue;
+        }
+        if (dev.syn_dropped) {
+            if (ev->type == EV_SYN && ev->code == SYN_REPORT) {
+                dev.syn_dropped = false;
+                // Recorded in the order it was handled, resync frame last
+                if (record_file) record_events(dev, evbuf + recorded, i + 1 - recorded);
+                recorded = i + 1;
+                resync_device_keys(dev, sink);
+            }
+            continue;
+        }
+        note_key_event(dev, ev);
+        sink(ev, read_ns, dev.index);
+    }
+    if (record_file && recorded < count) record_events(dev, evbuf + recorded, count - recorded);
+    ::count(metrics.devices[dev.index & 0xFF].events, count);
+}
+
+// Reads everything queued on a device in EVENT_BATCH sized chunks until the
+// kernel buffer is empty. Returns the number of events handled, or -1 if the
+// device is gone.
+int drain_event_device(event_device_t& dev, event_sink_t sink) {
+    struct input_event evbuf[EVENT_BATCH];
+    int total = 0;
+
+    for (;;) {
+        ssize_t len = read(dev.fd, evbuf, sizeof(evbuf));
+        if (len < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) break;
+            return -1;
+        }
+        if (len == 0) return -1;
+
+        size_t count = len / sizeof(struct input_event);
+        handle_device_events(dev, evbuf, count, sink);
+        total += count;
+
+        if (count < EVENT_BATCH) break; // Short read, the buffer is drained
+    }
+    return total;
+}
+
+// Threaded mode (--threaded). A capture thread drains the evdev fds on its
+// own epoll instance and passes compact events to the main thread, which
+// encodes and sends, through a lock-free single producer/single consumer
+// ring. A send() blocked on a congested link no longer stops device reads.
+template <typename T, size_t N>
+class spsc_ring {
+	static_assert((N & (N - 1)) == 0, "ring size must be a power of two");
+
+	alignas(64) std::atomic<size_t>	head{0};	// written by the producer only
+	alignas(64) std::atomic<size_t>	tail{0};	// written by the consumer only
+	alignas(64) T			slots[N];
+
+public:
+	bool push(const T& item) {
+		size_t h = head.load(std::memory_order_relaxed);
+		if (h - tail.load(std::memory_order_acquire) == N) return false;
+		slots[h & (N - 1)] = item;
+		head.store(h + 1, std::memory_order_release);
+		return true;
+	}
+
+	bool pop(T& item) {
+		size_t t = tail.load(std::memory_order_relaxed);
+		if (t == head.load(std::memory_order_acquire)) return false;
+		item = slots[t & (N - 1)];
+		tail.store(t + 1, std::memory_order_release);
+		return true;
+	}
+};
+
+struct ring_event_t {
+	uint64_t	time_ns;	// input_event.time
+	uint64_t	read_ns;	// for --trace
+	int32_t		value;
+	uint16_t	type;
+	uint16_t	code;
+	uint8_t		device;		// event_device_t::index
+};
+
+bool threaded = false;
+int rt_priority = 0;		// SCHED_FIFO priority for both threads, 0 leaves them SCHED_OTHER
+int capture_cpu = -1, sender_cpu = -1;
+bool lock_memory = false;
+
+spsc_ring<ring_event_t, RING_SIZE> event_ring;
+int ring_event_fd = -1;		// capture -> sender: events were pushed
+int capture_stop_fd = -1;	// sender -> capture: exit the loop
+fd_handler_t ring_handler, capture_stop_handler;
+std::thread capture_thread;
+bool capture_running = false;	// only touched by the capture thread once started
+bool ring_pushed = false;	// capture thread: wake the sender after this batch
+std::atomic<bool> capture_stopping{false};
+std::atomic<uint64_t> ring_full_waits{0};
+
+void ring_push(const ring_event_t& item) {
+    // A full ring means the sender is behind; hand it the CPU rather than
+    // dropping input. The events stay queued in the kernel meanwhile.
+    while (!event_ring.push(item)) {
+        if (capture_stopping.load(std::memory_order_relaxed)) return;
+        ring_full_waits.fetch_add(1, std::memory_order_relaxed);
+        uint64_t one = 1;
+        write(ring_event_fd, &one, sizeof(one));
+        sched_yield();
+    }
+    ring_pushed = true;
+}
+
+void ring_sink(struct input_event *ev, uint64_t read_ns, uint8_t device) {
+    ring_event_t item;
+    item.time_ns = (uint64_t)ev->input_event_sec * 1000000000ULL + ev->input_event_usec * 1000ULL;
+    item.read_ns = read_ns;
+    item.value = ev->value;
+    item.type = ev->type;
+    item.code = ev->code;
+    item.device = device;
+    ring_push(item);
+}
+
+// The staged tables of a device slot take effect in order with its events:
+// through the ring with --threaded, at once otherwise
+void publish_device_setup(uint8_t index) {
+    if (!threaded) {
+        apply_device_setup(index);
+        return;
+    }
+    ring_event_t item = {};
+    item.type = RING_DEVICE_SETUP;
+    item.device = index;
+    ring_push(item);
+}
+
+// Sender side: everything the capture thread pushed goes through the encoder
+void on_ring_event(fd_handler_t *handler, uint32_t events) {
+    uint64_t count;
+    if (read(handler->fd, &count, sizeof(count)) != sizeof(count)) return;
+
+    ring_event_t item;
+    while (event_ring.pop(item)) {
+        if (item.type == RING_DEVICE_SETUP) {
+            apply_device_setup(item.device);
+            continue;
+        }
+        struct input_event ev = {};
+        ev.input_event_sec = item.time_ns / 1000000000ULL;
+        ev.input_event_usec = item.time_ns % 1000000000ULL / 1000;
+        ev.type = item.type;
+        ev.code = item.code;
+        ev.value = item.value;
+        deliver_event(&ev, item.read_ns, item.device);
+    }
+}
+
+void on_capture_stop(fd_handler_t *handler, uint32_t events) {
+    uint64_t count;
+    read(handler->fd, &count, sizeof(count));
+    capture_running = false;
+}
+
+void tune_current_thread(const char *role, int cpu) {
+    if (rt_priority > 0) {
+        struct sched_param sp = {};
+        sp.sched_priority = rt_priority;
+        int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+        if (err) std::cerr << "Could not make the " << role << " thread SCHED_FIFO: " << strerror(err) << std::endl;
+    }
+    if (cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (err) std::cerr << "Could not pin the " << role << " thread to CPU " << cpu << ": " << strerror(err) << std::endl;
+    }
+}
+
+void capture_main() {
+    tune_current_thread("capture", capture_cpu);
+    capture_running = true;
+    while (capture_running) {
+        struct epoll_event evs[EPOLL_BATCH];
+        int ret = epoll_wait(device_epoll_fd, evs, EPOLL_BATCH, -1);
+        if (ret < 0) { if (errno == EINTR) continue; break; }
+        count(metrics.capture_wakeups);
+
+        for (int i = 0; i < ret; ++i) {
+            fd_handler_t *handler = static_cast<fd_handler_t *>(evs[i].data.ptr);
+            handler->on_event(handler, evs[i].events);
+        }
+
+        // One wakeup per batch, not per event
+        if (ring_pushed) {
+            ring_pushed = false;
+            uint64_t one = 1;
+            write(ring_event_fd, &one, sizeof(one));
+        }
+    }
+}
+
+void start_capture_thread() {
+    // Signals belong to the main thread, whose epoll_wait they interrupt
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    capture_stopping = false;
+    capture_thread = std::thread(capture_main);
+    pthread_sigmask(SIG_SETMASK, &old, nullptr);
+}
+
+void stop_capture_thread() {
+    if (!capture_thread.joinable()) return;
+    capture_stopping = true;
+    uint64_t one = 1;
+    write(capture_stop_fd, &one, sizeof(one));
+    capture_thread.join();
+
+    ring_event_t item;
+    while (event_ring.pop(item)) {} // Input for a link that is gone
+}
+
+void drop_event_device(event_device_t *dev) {
+    std::cout << "Input device went away, releasing it." << std::endl;
+    unwatch_fd(dev->fd, device_epoll_fd);
+    close(dev->fd);
+    metrics.devices[dev->index & 0xFF].grabbed.store(false, std::memory_order_relaxed);
+    free_device_slots.push_back(dev->index);
+    event_devices.remove_if([dev](const event_device_t& d) { return &d == dev; });
+}
+
+void on_event_device(fd_handler_t *handler, uint32_t events) {
+    event_device_t *dev = static_cast<event_device_t *>(handler->ctx);
+    if (drain_event_device(*dev, threaded ? ring_sink : deliver_event) < 0) drop_event_device(dev);
+}
+
+#ifdef WITH_IO_URING
+// A report waiting for the next io_uring_enter(), or in flight
+struct uring_send_t {
+	uring_op_t	op;
+	bool		busy;
+	host_session_t	*session;	// null once its link is closed
+	unsigned char	data[sizeof(keyb_report_u)];
+	size_t		len;
+	unsigned char	keys_before[32];	// as in queued_report_t
+	trace_record_t	trace;		// --trace: the input behind it
+};
+uring_send_t uring_sends[URING_SENDS];
+std::vector<uring_send_t *> uring_batch;	// reports of this loop turn, in order
+bool uring_poll_armed = false;
+
+bool uring_queue_send(host_session_t *s, const unsigned char *rep, size_t len) {
+    for (uring_send_t& u : uring_sends) {
+        if (u.busy) continue;
+        u.op = URING_SEND;
+        u.busy = true;
+        u.session = s;
+        memcpy(u.data, rep, len);
+        u.len = len;
+        memcpy(u.keys_before, s->accepted_keys, sizeof(u.keys_before));
+        u.trace = {};
+        if (trace_enabled && trace_pending.t[TP_PROCESSED]) {
+            u.trace = trace_pending;
+            u.trace.is_report = true;
+            u.trace.t[TP_SEND_START] = monotonic_ns();
+            trace_pending = {};
+        }
+        uring_batch.push_back(&u);
+        return true;
+    }
+    return false;
+}
+
+// Its link is closed: completions still to come only free their buffers
+void uring_forget_session(host_session_t *s) {
+    for (uring_send_t& u : uring_sends) {
+        if (u.busy && u.session == s) u.session = nullptr;
+    }
+    s->uring_inflight = 0;
+    s->uring_requeued = 0;
+}
+
+// Puts this turn's reports in the SQ, each session's as one linked chain.
+// When the link fills up part way, the rest of the chain fails with
+// ECANCELED instead of overtaking the report that did not fit.
+unsigned uring_flush_sends() {
+    unsigned n = 0;
+    if (uring_sq_space() < uring_batch.size()) uring_enter(0); // A chain must not span two submits
+    for (host_session_t& s : sessions) {
+        struct io_uring_sqe *prev = nullptr;
+        for (uring_send_t *u : uring_batch) {
+            if (u->session != &s) continue;
+            if (prev) prev->flags |= IOSQE_IO_LINK;
+            prev = uring_sqe(&u->op);
+            prev->opcode = IORING_OP_SEND;
+            prev->fd = s.intr;
+            prev->addr = reinterpret_cast<uintptr_t>(u->data);
+            prev->len = u->len;
+            prev->msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+            s.uring_inflight++;
+            n++;
+        }
+        // Reports that found no buffer
+        if (s.up && !s.uring_inflight && !s.send_queue.empty() && !s.draining) begin_stall(&s);
+    }
+    for (uring_send_t *u : uring_batch) {
+        if (!u->session) u->busy = false;
+    }
+    uring_batch.clear();
+    return n;
+}
+
+void uring_send_done(uring_send_t *u, int res) {
+    host_session_t *s = u->session;
+    u->busy = false;
+    if (!s) return;
+    s->uring_inflight--;
+
+    if (res >= 0) {
+        report_stats.sent++;
+        count(metrics.reports_sent[report_kind(u->data, s->boot_protocol) & 7]);
+        if (u->trace.t[TP_SEND_START]) {
+            u->trace.t[TP_SEND_END] = monotonic_ns();
+            trace_push(u->trace);
+        }
+    } else if (res == -EAGAIN || res == -ECANCELED) {
+        // Congested, or chained behind one that was: back in line, in order
+        queued_report_t q;
+        memcpy(q.data, u->data, u->len);
+        q.len = u->len;
+        memcpy(q.keys_before, u->keys_before, sizeof(q.keys_before));
+        s->send_queue.insert(s->send_queue.begin() + s->uring_requeued++, q);
+        count(metrics.queued);
+        report_stats.max_depth = std::max(report_stats.max_depth, s->send_queue.size());
+    } else {
+        errno = -res;
+        count(metrics.send_errors);
+        link_lost(s, "Send failed");
+    }
+
+    if (!s->uring_inflight) {
+        s->uring_requeued = 0;
+        if (s->up && !s->send_queue.empty() && !s->draining) begin_stall(s);
+        else if (s->send_queue.empty()) backlog_cleared(s);
+    }
+}
+
+void uring_read_done(uring_read_t *r, int res) {
+    event_device_t *dev = r->dev;
+    if (dev && (res == -EINTR || res == -EAGAIN)) {
+        uring_post_read(r);
+        return;
+    }
+    if (dev && res <= 0) {
+        dev->uring_read = nullptr;
+        drop_event_device(dev);
+    } else if (dev) {
+        handle_device_events(*dev, r->buf, res / sizeof(struct input_event), deliver_event);
+        if (r->dev) {
+            uring_post_read(r);
+            return;
+        }
+    }
+    delete r;
+}
+
+// epoll_fd became readable: run its handlers as the epoll loop would
+void uring_poll_done() {
+    struct epoll_event evs[EPOLL_BATCH];
+    int ret;
+    uring_poll_armed = false;
+    do {
+        ret = epoll_wait(epoll_fd, evs, EPOLL_BATCH, 0);
+        for (int i = 0; i < ret; ++i) {
+            fd_handler_t *handler = static_cast<fd_handler_t *>(evs[i].data.ptr);
+            handler->on_event(handler, evs[i].events);
+        }
+    } while (ret == EPOLL_BATCH);
+}
+
+// Send completions go first, so a session knows what got through before
+// input in the same batch makes new reports
+void uring_reap() {
+    struct io_uring_cqe done[EPOLL_BATCH * 4];
+    for (;;) {
+        unsigned head = *uring.cq_head, tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE), n = 0;
+        while (head != tail && n < sizeof(done) / sizeof(done[0])) done[n++] = uring.cqes[head++ & *uring.cq_mask];
+        __atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+        if (!n) return;
+
+        for (unsigned i = 0; i < n; ++i) {
+            uring_op_t *op = reinterpret_cast<uring_op_t *>(done[i].user_data);
+            if (*op == URING_SEND) uring_send_done(reinterpret_cast<uring_send_t *>(op), done[i].res);
+        }
+        for (unsigned i = 0; i < n; ++i) {
+            uring_op_t *op = reinterpret_cast<uring_op_t *>(done[i].user_data);
+            if (*op == URING_READ) uring_read_done(reinterpret_cast<uring_read_t *>(op), done[i].res);
+            else if (*op == URING_POLL) uring_poll_done();
+        }
+    }
+}
+
+// Sends what is waiting without sleeping for input: for --bench, and
+// before a link is closed
+void uring_settle() {
+    if (!uring_active()) return;
+    unsigned sends = uring_flush_sends();
+    if (!sends) return;
+    uring_enter(sends);
+    report_stats.send_calls++;
+    uring_reap();
+}
+
+// One turn of the main loop: submit what the last turn produced, sleep until
+// something completes, then handle it. Sends to a socket complete inside
+// io_uring_enter(), so waiting for one completion more than that sleeps
+// until the next input. With --trace it only waits for the sends, so their
+// completion times are taken straight away.
+bool uring_run_once() {
+    if (!uring_poll_armed) {
+        struct io_uring_sqe *sqe = uring_sqe(&uring_poll_op);
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = epoll_fd;
+        sqe->poll32_events = POLLIN;
+        uring_poll_armed = true;
+    }
+    unsigned sends = uring_flush_sends();
+    if (uring_enter(trace_enabled && sends ? sends : sends + 1) < 0 && errno != EINTR) {
+        std::cerr << "io_uring_enter failed: " << strerror(errno) << std::endl;
+        return false;
+    }
+    if (sends) report_stats.send_calls++;
+    count(metrics.main_wakeups);
+    uring_reap();
+    return true;
+}
+#endif
@@ -0,0 +1,961 @@
+// Host side of the core: the HIDP control channel, the loopback transport,
+// host sessions with pairing and reconnection, the metrics socket and the
+// main event loop.
+#include "bthid.h"
+
+volatile bool keep_running = true;
+int ctl_sock = -1, int_sock = -1;
+
+void signal_handler(int signum) {
+    std::cout << "\nCaught signal " << signum << ", shutting down." << std::endl;
+    keep_running = false;
+}
+
+// HIDP message handling. The host talks to us on both channels: requests
+// on the control channel each get a HANDSHAKE or DATA reply, and keyboard
+// LED output reports arrive on either one.
+
+// Control replies are tiny and rare, so they go out blocking
+void send_control(host_session_t *s, const unsigned char *msg, size_t len) {
+    if (send(s->ctl, msg, len, MSG_NOSIGNAL) < 0) {
+        count(metrics.send_errors);
+        link_lost(s, "Control send failed");
+    }
+}
+
+void send_handshake(host_session_t *s, unsigned char result) {
+    unsigned char msg = HIDP_HANDSHAKE | result;
+    send_control(s, &msg, 1);
+}
+
+// Only the host with focus drives the local keyboard's LEDs
+void set_session_leds(host_session_t *s, unsigned char leds) {
+    s->leds = leds & 0x1F;
+    if (s == focus) set_host_leds(s->leds);
+}
+
+// GET_REPORT is answered from the current state, not the last report sent
+void answer_get_report(host_session_t *s, const unsigned char *msg, ssize_t len) {
+    unsigned char type = msg[0] & 0x03;
+    if (type == 0 || len < 2) {
+        send_handshake(s, HIDP_HSHK_INVALID_PARAMETER);
+        return;
+    }
+
+    // A host without focus is holding nothing
+    static const unsigned char nothing[sizeof(keybits)] = { 0 };
+    bool current = s == focus;
+    bool boot = s->boot_protocol;
+    unsigned char id = msg[1];
+    unsigned char buf[sizeof(keyb_report_u)];
+    size_t n = 0;
+    if (type == HIDP_REPORT_INPUT && id == keyb_report_id(boot)) {
+        keyb_report_u evkeyb;
+        n = encode_keyb_report(&evkeyb, current ? keybits : nothing, boot);
+        memcpy(buf, &evkeyb, n);
+    } else if (type == HIDP_REPORT_INPUT && id == mouse_report_id(boot)) {
+        n = encode_mouse_report(buf, current ? mousebuttons & 0x07 : 0, boot);
+    } else if (type == HIDP_REPORT_INPUT && id == REPORTID_CONSUMER && !boot) {
+        hidrep_consumer_t evconsumer = { 0xA1, REPORTID_CONSUMER, htole16(current ? consumerkey : 0) };
+        n = sizeof(evconsumer);
+        memcpy(buf, &evconsumer, n);
+    } else if (type == HIDP_REPORT_INPUT && id == REPORTID_GAMEPAD && gamepad && !boot) {
+        hidrep_gamepad_t evpad;
+        encode_gamepad_report(&evpad, current);
+        n = sizeof(evpad);
+        memcpy(buf, &evpad, n);
+    } else if (type == HIDP_REPORT_OUTPUT && id == keyb_report_id(boot)) {
+        buf[0] = HIDP_DATA | HIDP_REPORT_OUTPUT;
+        buf[1] = id;
+        buf[2] = s->leds;
+        n = 3;
+    } else if (type == HIDP_REPORT_FEATURE && id == REPORTID_MOUSE && mouse_hires && !boot) {
+        buf[0] = HIDP_DATA | HIDP_REPORT_FEATURE;
+        buf[1] = id;
+        buf[2] = s->wheel_multiplier > 1 ? 0x05 : 0x00; // Both 2-bit multiplier fields
+        n = 3;
+    } else {
+        send_handshake(s, HIDP_HSHK_INVALID_REPORT_ID);
+        return;
+    }
+
+    // The host may limit the size, counted without the header byte
+    if ((msg[0] & HIDP_GET_REPORT_SIZE) && len >= 4) {
+        n = std::min<size_t>(n, (msg[2] | (msg[3] << 8)) + 1);
+    }
+    send_control(s, buf, n);
+}
+
+void answer_set_report(host_session_t *s, const unsigned char *msg, ssize_t len) {
+    unsigned char type = msg[0] & 0x03;
+    if (len < 3) {
+        send_handshake(s, HIDP_HSHK_INVALID_PARAMETER);
+    } else if (type == HIDP_REPORT_OUTPUT && msg[1] == keyb_report_id(s->boot_protocol)) {
+        set_session_leds(s, msg[2]);
+        send_handshake(s, HIDP_HSHK_SUCCESS);
+    } else if (type == HIDP_REPORT_FEATURE && msg[1] == REPORTID_MOUSE && mouse_hires && !s->boot_protocol) {
+        s->wheel_multiplier = (msg[2] & 0x03) ? WHEEL_UNIT : 1;
+        send_handshake(s, HIDP_HSHK_SUCCESS);
+    } else {
+        send_handshake(s, HIDP_HSHK_INVALID_REPORT_ID);
+    }
+}
+
+void set_protocol(host_session_t *s, bool boot) {
+    if (boot != s->boot_protocol) {
+        std::cout << "Host " << s->number << " switched to the " << (boot ? "boot" : "report")
+                  << " protocol." << std::endl;
+        s->boot_protocol = boot;
+        // The boot report has no Resolution Multiplier or horizontal wheel
+        if (boot) s->wheel_multiplier = 1;
+        // Anything queued is in the old format; resend the state in the new one
+        reset_report_history(s);
+        if (s == focus) {
+            keyb_dirty = mouse_dirty = consumer_dirty = gamepad_dirty = true;
+            if (boot) dh = 0;
+        }
+    }
+    send_handshake(s, HIDP_HSHK_SUCCESS);
+}
+
+void handle_control_message(host_session_t *s, const unsigned char *msg, ssize_t len) {
+    unsigned char reply[2] = { HIDP_DATA, 0 };
+    switch (msg[0] & 0xF0) {
+        case HIDP_HID_CONTROL:
+            // Suspend and exit suspend need no answer; we are always ready
+            if ((msg[0] & 0x0F) == HIDP_CTRL_VIRTUAL_CABLE_UNPLUG) {
+                std::cout << "Host " << s->number << " unplugged the virtual cable." << std::endl;
+                s->unplugged = true;
+                s->up = false;
+            }
+            break;
+        case HIDP_GET_REPORT:
+            answer_get_report(s, msg, len);
+            break;
+        case HIDP_SET_REPORT:
+            answer_set_report(s, msg, len);
+            break;
+        case HIDP_GET_PROTOCOL:
+            reply[1] = s->boot_protocol ? HIDP_PROTOCOL_BOOT : HIDP_PROTOCOL_REPORT;
+            send_control(s, reply, sizeof(reply));
+            break;
+        case HIDP_SET_PROTOCOL:
+            set_protocol(s, (msg[0] & 0x01) == HIDP_PROTOCOL_BOOT);
+            break;
+        case HIDP_GET_IDLE:
+            reply[1] = s->idle_rate;
+            send_control(s, reply, sizeof(reply));
+            break;
+        case HIDP_SET_IDLE:
+            if (len >= 2) s->idle_rate = msg[1];
+            send_handshake(s, len >= 2 ? HIDP_HSHK_SUCCESS : HIDP_HSHK_INVALID_PARAMETER);
+            break;
+        default:
+            send_handshake(s, HIDP_HSHK_UNSUPPORTED);
+            break;
+    }
+}
+
+// Only output reports travel host -> device on the interrupt channel
+void handle_interrupt_message(host_session_t *s, const unsigned char *msg, ssize_t len) {
+    if (len >= 3 && msg[0] == (HIDP_DATA | HIDP_REPORT_OUTPUT) && msg[1] == keyb_report_id(s->boot_protocol)) {
+        set_session_leds(s, msg[2]);
+    }
+}
+
+// A session's channels carry host messages and hangups, the interrupt
+// channel also room to send while reports are queued
+void on_link_event(fd_handler_t *handler, uint32_t events) {
+    host_session_t *s = static_cast<host_session_t *>(handler->ctx);
+    if (events & EPOLLIN) {
+        unsigned char msg[64];
+        ssize_t len;
+        while (s->up && (len = recv(handler->fd, msg, sizeof(msg), MSG_DONTWAIT)) > 0) {
+            if (handler == &s->ctl_handler) handle_control_message(s, msg, len);
+            else handle_interrupt_message(s, msg, len);
+        }
+    }
+    if (events & (EPOLLHUP | EPOLLRDHUP | EPOLLERR)) {
+        if (s->up) std::cout << "Host " << s->number << ": connection lost." << std::endl;
+        s->up = false;
+        return;
+    }
+    if ((events & EPOLLOUT) && s->up) drain_send_queue(s);
+}
+
+// Loopback backend: the two channels become AF_UNIX SOCK_SEQPACKET sockets at
+// <path>.ctl and <path>.int, which keep L2CAP's message boundaries. Used
+// with --host to run the whole pipeline on a machine without an adapter.
+std::string unix_path;
+
+bool unix_addr(const std::string& path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr->sun_path)) {
+        std::cerr << "Socket path too long: " << path << std::endl;
+        return false;
+    }
+    memcpy(addr->sun_path, path.c_str(), path.size());
+    return true;
+}
+
+bool unix_open_listeners() {
+    int *socks[2] = { &ctl_sock, &int_sock };
+    const char *suffix[2] = { ".ctl", ".int" };
+
+    for (int i = 0; i < 2; ++i) {
+        struct sockaddr_un addr;
+        std::string path = unix_path + suffix[i];
+        if (!unix_addr(path, &addr)) return false;
+        unlink(path.c_str());
+
+        *socks[i] = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (*socks[i] < 0 || bind(*socks[i], (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+            listen(*socks[i], HOSTS_MAX) < 0) {
+            std::cerr << "Error setting up " << path << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// A host that bound its sockets to BASE.ctl and BASE.int is known as BASE,
+// the way a Bluetooth host is known by its address; an unbound one by its
+// process
+int unix_accept_channel(int listener, std::string *peer) {
+    struct sockaddr_un addr;
+    socklen_t len = sizeof(addr);
+    int sock = accept4(listener, (struct sockaddr *)&addr, &len, SOCK_CLOEXEC);
+    if (sock < 0) return -1;
+
+    size_t path_len = len > offsetof(struct sockaddr_un, sun_path) ? len - offsetof(struct sockaddr_un, sun_path) : 0;
+    std::string path(addr.sun_path, strnlen(addr.sun_path, path_len));
+    if (path.size() > 4 && (path.compare(path.size() - 4, 4, ".ctl") == 0 || path.compare(path.size() - 4, 4, ".int") == 0)) {
+        *peer = path.substr(0, path.size() - 4);
+    } else {
+        struct ucred cred = {};
+        socklen_t cred_len = sizeof(cred);
+        getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len);
+        *peer = "pid " + std::to_string(cred.pid);
+    }
+    return sock;
+}
+
+// A host known by its base path listens there while its link is down
+int unix_connect_channel(const std::string& peer, bool interrupt) {
+    struct sockaddr_un addr;
+    if (!unix_addr(peer + (interrupt ? ".int" : ".ctl"), &addr)) return -1;
+
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock < 0) return -1;
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+const transport_t transport_unix = { "unix", false, unix_open_listeners, unix_accept_channel, unix_connect_channel };
+const transport_t *transport = nullptr;	// chosen by main
+
+// Host sessions. The listening control socket stays in the epoll set, so
+// hosts can connect at any time, and the input devices stay grabbed while
+// at least one session exists. A session whose link drops is kept for
+// reconnect_window seconds with its focus and settings: the host can come
+// back on its own, and where the transport can page a host we reconnect
+// to it ourselves with exponential backoff.
+std::list<host_session_t> sessions; // list: handlers need stable addresses
+host_session_t *focus = nullptr;
+int reconnect_window = RECONNECT_WINDOW_DEFAULT;	// seconds, 0 = forget a host once it drops
+int reconnect_timer_fd = -1;
+fd_handler_t reconnect_timer_handler, listen_handler;
+int next_session_number = 1;
+
+// A host opens its control channel first and its interrupt channel next.
+// Until the second one arrives the control channel waits here under the
+// host's address, so two hosts connecting at once are never crossed, and
+// a host that never opens its interrupt channel is dropped after a while.
+struct half_open_t {
+	std::string	peer;
+	int		ctl;
+	uint64_t	deadline_ns;
+};
+std::vector<half_open_t> half_open;
+int pair_timer_fd = -1;
+fd_handler_t int_listen_handler, pair_timer_handler;
+
+void set_focus(host_session_t *s) {
+    focus = s;
+    set_host_leds(s->leds);
+    std::cout << "Input goes to host " << s->number << " (" << s->peer << ")." << std::endl;
+}
+
+// The switch hotkey: the host losing focus is told everything is released,
+// the one gaining it is sent what is held now, diffed against what it was
+// last told, so neither sees a key stuck down or a phantom press
+void switch_focus() {
+    if (!focus) return;
+    auto it = std::find_if(sessions.begin(), sessions.end(), [](const host_session_t& s) { return &s == focus; });
+    for (size_t i = 1; i < sessions.size(); ++i) {
+        if (++it == sessions.end()) it = sessions.begin();
+        if (!it->up) continue;
+
+        if (focus->up) release_host_keys(focus);
+        dx = dy = dz = dh = 0;
+        set_focus(&*it);
+        keyb_dirty = mouse_dirty = true;	// sent with the frame of the switch key
+        return;
+    }
+}
+
+void activate_session(host_session_t *s, int ctl, int intr) {
+    s->ctl = ctl;
+    s->intr = intr;
+    s->ctl_handler = {ctl, on_link_event, s};
+    s->int_handler = {intr, on_link_event, s};
+    watch_fd(&s->ctl_handler, EPOLLIN | EPOLLRDHUP);
+    watch_fd(&s->int_handler, EPOLLIN | EPOLLRDHUP);
+    // Congestion must surface as EAGAIN, not as a full kernel buffer
+    int sndbuf = SEND_BUFFER_BYTES;
+    setsockopt(intr, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    fcntl(intr, F_SETFL, fcntl(intr, F_GETFL) | O_NONBLOCK);
+
+    s->up = true;
+    s->boot_protocol = false;
+    s->wheel_multiplier = 1;
+    s->idle_rate = 0;
+    s->leds = 0;
+    s->unplugged = false;
+    reset_report_history(s);
+
+    if (s->lost_ns) {
+        std::cout << "Host " << s->number << " back " << (monotonic_ns() - s->lost_ns) / 1000000
+                  << " ms after the link dropped." << std::endl;
+        // It may still think keys from before the drop are down
+        s->last_keyb_len = 0;
+        s->last_consumer_usage = 0xFFFF;
+        s->last_mouse_buttons = 0xFF;
+        s->last_gamepad_report.hat = 0xFF;
+        release_host_keys(s);
+        s->lost_ns = 0;
+    }
+    if (s == focus) set_host_leds(s->leds);
+}
+
+// Closes both channels of a session and forgets what was waiting on them
+void close_session_channels(host_session_t *s) {
+    unwatch_fd(s->ctl);
+    unwatch_fd(s->intr);
+    close(s->ctl);
+    close(s->intr);
+    s->ctl = s->intr = -1;
+    s->send_queue.clear();
+    s->draining = false;
+    uring_forget_session(s);
+    // Keys stay tracked for the host's return; motion meanwhile is stale
+    if (s == focus) dx = dy = dz = dh = 0;
+}
+
+// The link of a session went down: close it and decide whether to wait for
+// the host to come back
+void session_down(host_session_t *s) {
+    close_session_channels(s);
+    if (s->unplugged || reconnect_window == 0 || !keep_running) {
+        s->dead = true;
+        return;
+    }
+    s->lost_ns = monotonic_ns();
+    s->backoff_ms = RECONNECT_BACKOFF_MIN_MS;
+    // Give a host that reconnects on its own a moment before paging it
+    s->next_attempt_ns = s->lost_ns + RECONNECT_BACKOFF_MIN_MS * 1000000ULL;
+    std::cout << "Host " << s->number << " dropped, waiting " << reconnect_window
+              << " s for it to come back." << std::endl;
+}
+
+void arm_reconnect_timer() {
+    uint64_t due = 0;
+    for (const host_session_t& s : sessions) {
+        if (!s.up && !s.dead && (!due || s.next_attempt_ns < due)) due = s.next_attempt_ns;
+    }
+    struct itimerspec its = { };
+    its.it_value.tv_sec = due / 1000000000ULL;
+    its.it_value.tv_nsec = due % 1000000000ULL;
+    timerfd_settime(reconnect_timer_fd, TFD_TIMER_ABSTIME, &its, nullptr);
+}
+
+// Gives up on the page in progress, if any
+void abort_connect(host_session_t *s) {
+    for (int& sock : s->connecting) {
+        if (sock < 0) continue;
+        unwatch_fd(sock);
+        close(sock);
+        sock = -1;
+    }
+}
+
+void connect_failed(host_session_t *s) {
+    abort_connect(s);
+    s->next_attempt_ns = monotonic_ns() + s->backoff_ms * 1000000ULL;
+    s->backoff_ms = std::min(s->backoff_ms * 2, RECONNECT_BACKOFF_MAX_MS);
+}
+
+void on_connect_event(fd_handler_t *handler, uint32_t events);
+
+// Starts paging one channel of the host; EPOLLOUT tells how it went
+bool start_connect(host_session_t *s, bool interrupt) {
+    int sock = transport->connect_channel(s->peer, interrupt);
+    if (sock < 0) return false;
+    s->connecting[interrupt] = sock;
+    s->connect_handler = {sock, on_connect_event, s};
+    watch_fd(&s->connect_handler, EPOLLOUT);
+    return true;
+}
+
+// Control channel first, then interrupt, as the HID profile requires
+void on_connect_event(fd_handler_t *handler, uint32_t events) {
+    host_session_t *s = static_cast<host_session_t *>(handler->ctx);
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(handler->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) err = errno;
+    if (err) {
+        connect_failed(s);
+        return;
+    }
+
+    unwatch_fd(handler->fd);
+    if (s->connecting[1] < 0) {
+        if (!start_connect(s, true)) connect_failed(s);
+        return;
+    }
+    int ctl = s->connecting[0], intr = s->connecting[1];
+    s->connecting[0] = s->connecting[1] = -1;
+    fcntl(ctl, F_SETFL, fcntl(ctl, F_GETFL) & ~O_NONBLOCK);
+    std::cout << "Reconnected to " << s->peer << std::endl;
+    activate_session(s, ctl, intr);
+}
+
+void on_reconnect_timer(fd_handler_t *handler, uint32_t events) {
+    uint64_t expirations;
+    if (read(handler->fd, &expirations, sizeof(expirations)) < 0) return;
+
+    uint64_t now = monotonic_ns();
+    for (host_session_t& s : sessions) {
+        if (s.up || s.dead || s.next_attempt_ns > now) continue;
+
+        if (now - s.lost_ns >= (uint64_t)reconnect_window * 1000000000ULL) {
+            std::cout << "Host " << s.number << " did not come back." << std::endl;
+            abort_connect(&s);
+            s.dead = true;
+            continue;
+        }
+        if (s.connecting[0] >= 0) {
+            connect_failed(&s); // The host did not answer the page in time
+            continue;
+        }
+        if (transport->connect_channel && start_connect(&s, false)) {
+            s.next_attempt_ns = now + RECONNECT_PAGE_TIMEOUT * 1000000000ULL;
+            continue;
+        }
+        s.next_attempt_ns = now + s.backoff_ms * 1000000ULL;
+        s.backoff_ms = std::min(s.backoff_ms * 2, RECONNECT_BACKOFF_MAX_MS);
+    }
+}
+
+host_session_t *add_session(const std::string& peer) {
+    sessions.emplace_back();
+    host_session_t *s = &sessions.back();
+    s->peer = peer;
+    s->number = next_session_number++;
+    s->dead = false;
+    s->lost_ns = 0;
+    s->connecting[0] = s->connecting[1] = -1;
+    return s;
+}
+
+// Both channels are up: a new session, or a host coming back
+void host_connected(int ctl, int intr, const std::string& peer) {
+    // A host coming back takes its old session, even one whose old link
+    // has not been seen to drop yet, as after a silent drop
+    for (host_session_t& s : sessions) {
+        if (s.dead || s.peer != peer) continue;
+        if (s.up) {
+            std::cout << "Host " << s.number << " connected again, closing its stale link." << std::endl;
+            close_session_channels(&s);
+            s.up = false;
+            s.lost_ns = monotonic_ns();
+        }
+        abort_connect(&s);
+        activate_session(&s, ctl, intr);
+        return;
+    }
+
+    if (sessions.size() >= HOSTS_MAX) {
+        std::cerr << "Already serving " << HOSTS_MAX << " hosts, refusing " << peer << std::endl;
+        close(ctl);
+        close(intr);
+        return;
+    }
+    if (sessions.empty() && !replay_events) {
+        if (init_event_devices() <= 0) {
+            std::cerr << "Could not grab any input devices. Closing connection." << std::endl;
+            close(ctl);
+            close(intr);
+            return;
+        }
+        if (threaded) start_capture_thread();
+    }
+
+    host_session_t *s = add_session(peer);
+    activate_session(s, ctl, intr);
+    std::cout << "\nHost " << s->number << " connected! Forwarding inputs..." << std::endl;
+
+    if (!focus_up()) set_focus(s);
+    // After the channels are watched, so requests the host sent while
+    // connecting are answered before the first replayed input
+    if (replay_events && sessions.size() == 1) start_replay();
+}
+
+void arm_pair_timer() {
+    uint64_t due = 0;
+    for (const half_open_t& h : half_open) {
+        if (!due || h.deadline_ns < due) due = h.deadline_ns;
+    }
+    struct itimerspec its = { };
+    its.it_value.tv_sec = due / 1000000000ULL;
+    its.it_value.tv_nsec = due % 1000000000ULL;
+    timerfd_settime(pair_timer_fd, TFD_TIMER_ABSTIME, &its, nullptr);
+}
+
+void on_pair_timer(fd_handler_t *handler, uint32_t events) {
+    uint64_t expirations;
+    if (read(handler->fd, &expirations, sizeof(expirations)) < 0) return;
+
+    uint64_t now = monotonic_ns();
+    for (auto it = half_open.begin(); it != half_open.end(); ) {
+        if (it->deadline_ns > now) {
+            ++it;
+            continue;
+        }
+        std::cerr << "No interrupt connection from " << it->peer << ", closing its control connection." << std::endl;
+        close(it->ctl);
+        it = half_open.erase(it);
+    }
+    arm_pair_timer();
+}
+
+// Either listener. The control listener is drained first, so an interrupt
+// channel reported in the same batch finds the control channel it belongs to.
+void on_listen_event(fd_handler_t *handler, uint32_t events) {
+    std::string peer;
+    int sock;
+    while ((sock = transport->accept_channel(ctl_sock, &peer)) >= 0) {
+        std::cout << "Control connection accepted from " << peer << std::endl;
+        // A host starting over replaces its earlier attempt
+        for (auto it = half_open.begin(); it != half_open.end(); ++it) {
+            if (it->peer == peer) {
+                close(it->ctl);
+                half_open.erase(it);
+                break;
+            }
+        }
+        if (half_open.size() >= HOSTS_MAX) {
+            close(half_open.front().ctl);
+            half_open.erase(half_open.begin());
+        }
+        half_open.push_back({ peer, sock, monotonic_ns() + PAIR_TIMEOUT_MS * 1000000ULL });
+    }
+
+    while ((sock = transport->accept_channel(int_sock, &peer)) >= 0) {
+        auto it = std::find_if(half_open.begin(), half_open.end(), [&peer](const half_open_t& h) { return h.peer == peer; });
+        if (it == half_open.end()) {
+            std::cerr << "Interrupt connection from " << peer << " without a control connection, closing it." << std::endl;
+            close(sock);
+            continue;
+        }
+        std::cout << "Interrupt connection accepted from " << peer << std::endl;
+        int ctl = it->ctl;
+        half_open.erase(it);
+        host_connected(ctl, sock, peer);
+    }
+    arm_pair_timer();
+}
+
+// Runs after every epoll batch, when no handler pointer from the batch is
+// still in use: closes dropped links, forgets sessions that are done, and
+// releases the devices once no host is left.
+void reap_sessions() {
+    bool had_sessions = !sessions.empty();
+    for (auto it = sessions.begin(); it != sessions.end(); ) {
+        if (!it->up && it->ctl >= 0) session_down(&*it);
+        if (!it->dead) {
+            ++it;
+            continue;
+        }
+        if (focus == &*it) focus = nullptr;
+        abort_connect(&*it);
+        it = sessions.erase(it);
+    }
+
+    if (!focus_up()) {
+        for (host_session_t& s : sessions) {
+            if (s.up) {
+                set_focus(&s);
+                break;
+            }
+        }
+        // Otherwise focus stays with a host that may come back
+        if (!focus && !sessions.empty()) focus = &sessions.front();
+    }
+    if (reconnect_timer_fd >= 0) arm_reconnect_timer();
+
+    if (had_sessions && sessions.empty()) {
+        disarm_report_timer();
+        clear_input_state();
+        print_report_jitter();
+        print_report_stats();
+        stop_capture_thread();
+        if (grabbing) close_event_devices();
+        if (record_file) fflush(record_file);
+        if (keep_running) std::cout << "No hosts left. Waiting for new connection..." << std::endl;
+    }
+}
+
+// At exit: let queued reports out and close every link
+void close_sessions() {
+    for (host_session_t& s : sessions) {
+        if (s.up) flush_send_queue(&s, SEND_FLUSH_TIMEOUT_MS);
+        s.up = false;
+        s.dead = true;
+    }
+    reap_sessions();
+}
+
+// Metrics (--metrics PATH). A client of the AF_UNIX stream socket sends a
+// request, any request, and gets one HTTP/1.0 response with the counters in
+// Prometheus text format, so curl --unix-socket or a scraper behind a
+// socket proxy can read it. Formatting happens here, off the hot path.
+std::string metrics_path;
+metrics_t metrics;
+int metrics_sock = -1;
+fd_handler_t metrics_handler;
+std::list<fd_handler_t> metrics_clients;	// waiting for their request
+uint64_t start_ns = 0;
+
+const char *report_kind_name(int kind) {
+    switch (kind) {
+        case REPORTID_MOUSE:	return "mouse";
+        case REPORTID_KEYBD:	return "keyboard";
+        case REPORTID_CONSUMER:	return "consumer";
+        case REPORTID_GAMEPAD:	return "gamepad";
+        default:		return nullptr;
+    }
+}
+
+void appendf(std::string& out, const char *fmt, ...) {
+    char buf[256];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    out += buf;
+}
+
+void metric_header(std::string& out, const char *name, const char *type, const char *help) {
+    appendf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+std::string format_metrics() {
+    std::string out;
+    auto relaxed = [](const std::atomic<uint64_t>& c) {
+        return (unsigned long long)c.load(std::memory_order_relaxed);
+    };
+
+    metric_header(out, "bthid_uptime_seconds", "gauge", "Time since the emulator started.");
+    appendf(out, "bthid_uptime_seconds %.3f\n", (monotonic_ns() - start_ns) / 1e9);
+
+    // Devices are grabbed on the capture thread with --threaded: copy each
+    // slot once, under its generation, and print from the copies
+    struct device_row_t {
+        char		path[64];
+        bool		grabbed;
+        uint64_t	events;
+    };
+    std::vector<device_row_t> rows;
+    for (const device_metrics_t& d : metrics.devices) {
+        device_row_t row;
+        if (read_device_metrics(d, row.path, &row.grabbed, &row.events)) rows.push_back(row);
+    }
+    metric_header(out, "bthid_device_grabbed", "gauge", "Whether an input device is currently grabbed.");
+    for (const device_row_t& row : rows) {
+        appendf(out, "bthid_device_grabbed{device=\"%s\"} %d\n", row.path, (int)row.grabbed);
+    }
+    metric_header(out, "bthid_device_events_total", "counter", "Input events read from a device since it was grabbed.");
+    for (const device_row_t& row : rows) {
+        appendf(out, "bthid_device_events_total{device=\"%s\"} %llu\n", row.path, (unsigned long long)row.events);
+    }
+
+    metric_header(out, "bthid_reports_sent_total", "counter", "Reports sent to hosts, by report type.");
+    for (int kind = 0; kind < 8; ++kind) {
+        if (report_kind_name(kind)) {
+            appendf(out, "bthid_reports_sent_total{type=\"%s\"} %llu\n", report_kind_name(kind),
+                    relaxed(metrics.reports_sent[kind]));
+        }
+    }
+    metric_header(out, "bthid_reports_suppressed_total", "counter", "Frames whose report matched the last one sent.");
+    appendf(out, "bthid_reports_suppressed_total %llu\n", relaxed(metrics.suppressed));
+    metric_header(out, "bthid_reports_queued_total", "counter", "Reports that waited for a congested link.");
+    appendf(out, "bthid_reports_queued_total %llu\n", relaxed(metrics.queued));
+    metric_header(out, "bthid_reports_merged_total", "counter", "Queued reports folded into the one before them.");
+    appendf(out, "bthid_reports_merged_total %llu\n", relaxed(metrics.merged));
+    metric_header(out, "bthid_link_stalls_total", "counter", "Times a link stopped taking reports.");
+    appendf(out, "bthid_link_stalls_total %llu\n", relaxed(metrics.stalls));
+    metric_header(out, "bthid_link_stall_seconds_total", "counter", "Time spent with a congested link.");
+    appendf(out, "bthid_link_stall_seconds_total %.6f\n", relaxed(metrics.stall_ns) / 1e9);
+    metric_header(out, "bthid_send_errors_total", "counter", "Sends that failed and ended a link.");
+    appendf(out, "bthid_send_errors_total %llu\n", relaxed(metrics.send_errors));
+
+    metric_header(out, "bthid_wakeups_total", "counter", "Event loop wakeups, by loop.");
+    appendf(out, "bthid_wakeups_total{loop=\"main\"} %llu\n", relaxed(metrics.main_wakeups));
+    if (threaded) appendf(out, "bthid_wakeups_total{loop=\"capture\"} %llu\n", relaxed(metrics.capture_wakeups));
+    if (threaded) {
+        metric_header(out, "bthid_ring_full_waits_total", "counter", "Times the capture thread found the ring full.");
+        appendf(out, "bthid_ring_full_waits_total %llu\n", relaxed(ring_full_waits));
+    }
+
+    metric_header(out, "bthid_host_up", "gauge", "Whether a host's link is connected.");
+    for (const host_session_t& h : sessions) {
+        appendf(out, "bthid_host_up{host=\"%d\",peer=\"%s\"} %d\n", h.number, h.peer.c_str(), (int)h.up);
+    }
+    metric_header(out, "bthid_host_focused", "gauge", "Whether input goes to a host.");
+    for (const host_session_t& h : sessions) {
+        appendf(out, "bthid_host_focused{host=\"%d\"} %d\n", h.number, (int)(&h == focus));
+    }
+    metric_header(out, "bthid_host_boot_protocol", "gauge", "Whether a host switched to the boot protocol.");
+    for (const host_session_t& h : sessions) {
+        appendf(out, "bthid_host_boot_protocol{host=\"%d\"} %d\n", h.number, (int)h.boot_protocol);
+    }
+    metric_header(out, "bthid_host_queued_reports", "gauge", "Reports waiting for a host's link.");
+    for (const host_session_t& h : sessions) {
+        appendf(out, "bthid_host_queued_reports{host=\"%d\"} %zu\n", h.number, h.send_queue.size());
+    }
+    return out;
+}
+
+void on_metrics_client(fd_handler_t *handler, uint32_t events) {
+    char request[1024];
+    while (recv(handler->fd, request, sizeof(request), MSG_DONTWAIT) > 0) {}
+
+    std::string body = format_metrics();
+    std::string reply = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                        "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+    // A few KB fit the socket buffer, so this never waits on the reader
+    send(handler->fd, reply.data(), reply.size(), MSG_NOSIGNAL);
+    unwatch_fd(handler->fd);
+    close(handler->fd);
+    metrics_clients.remove_if([handler](const fd_handler_t& c) { return &c == handler; });
+}
+
+void on_metrics_event(fd_handler_t *handler, uint32_t events) {
+    int client;
+    while ((client = accept4(handler->fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        metrics_clients.push_back({client, on_metrics_client, nullptr});
+        if (!watch_fd(&metrics_clients.back(), EPOLLIN | EPOLLRDHUP)) {
+            close(client);
+            metrics_clients.pop_back();
+        }
+    }
+}
+
+bool open_metrics_socket() {
+    struct sockaddr_un addr;
+    if (!unix_addr(metrics_path, &addr)) return false;
+    unlink(metrics_path.c_str());
+    metrics_sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (metrics_sock < 0 || bind(metrics_sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(metrics_sock, 4) < 0) {
+        std::cerr << "Error setting up " << metrics_path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    metrics_handler = {metrics_sock, on_metrics_event, nullptr};
+    return watch_fd(&metrics_handler, EPOLLIN);
+}
+
+// Startup shared by the emulator and the benchmark: pointer curves, pad
+// calibration, tracing, capture files, the keymap and io_uring. Null paths
+// are skipped.
+bool init_pipeline(const char *record_path, const char *replay_path, const char *keymap_path) {
+    start_ns = monotonic_ns();
+    build_pointer_curve(&default_curve);
+    device_curves.fill(&default_curve);
+    for (pad_calib_t& c : pad_calibs) default_pad_calib(&c);
+
+    if (trace_enabled) {
+        trace_ring.resize(TRACE_RING_SIZE);
+        signal(SIGUSR1, trace_signal_handler);
+    }
+
+    if (record_path && !open_capture_for_record(record_path)) {
+        return false;
+    }
+    if (replay_path && !open_capture_for_replay(replay_path)) {
+        return false;
+    }
+    if (keymap_path && !load_keymap(keymap_path)) {
+        return false;
+    }
+    if (use_io_uring) uring_start();
+    return true;
+}
+
+// Serves hosts on the chosen transport until a signal, or until a replay
+// ends. hid_descriptor is built and the SDP record registered by then.
+int run_emulator() {
+    if (!transport->open_listeners()) {
+        return 1;
+    }
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        std::cerr << "Error creating epoll instance: " << strerror(errno) << std::endl;
+        return 1;
+    }
+
+    report_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (report_timer_fd < 0) {
+        std::cerr << "Error creating report timer: " << strerror(errno) << std::endl;
+        return 1;
+    }
+    report_timer_handler = {report_timer_fd, on_report_timer, nullptr};
+    watch_fd(&report_timer_handler, EPOLLIN);
+    if (!metrics_path.empty() && !open_metrics_socket()) {
+        return 1;
+    }
+
+    device_epoll_fd = epoll_fd;
+    if (threaded) {
+        device_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        ring_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        capture_stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (device_epoll_fd < 0 || ring_event_fd < 0 || capture_stop_fd < 0) {
+            std::cerr << "Error setting up the capture thread: " << strerror(errno) << std::endl;
+            return 1;
+        }
+        ring_handler = {ring_event_fd, on_ring_event, nullptr};
+        watch_fd(&ring_handler, EPOLLIN);
+        capture_stop_handler = {capture_stop_fd, on_capture_stop, nullptr};
+        watch_fd(&capture_stop_handler, EPOLLIN, device_epoll_fd);
+    }
+    if (!replay_events && !start_device_manager()) {
+        return 1;
+    }
+    tune_current_thread(threaded ? "sender" : "main", sender_cpu);
+    if (lock_memory && mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+        std::cerr << "mlockall failed: " << strerror(errno) << std::endl;
+    }
+
+    if (replay_events) {
+        replay_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (replay_timer_fd < 0) {
+            std::cerr << "Error creating replay timer: " << strerror(errno) << std::endl;
+            return 1;
+        }
+        replay_handler = {replay_timer_fd, on_replay_timer, nullptr};
+        watch_fd(&replay_handler, EPOLLIN);
+    }
+
+    if (!remap_layers.empty()) {
+        remap_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (remap_timer_fd < 0) {
+            std::cerr << "Error creating remap timer: " << strerror(errno) << std::endl;
+            return 1;
+        }
+        remap_timer_handler = {remap_timer_fd, on_remap_timer, nullptr};
+        watch_fd(&remap_timer_handler, EPOLLIN);
+    }
+
+    if (reconnect_window > 0) {
+        reconnect_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (reconnect_timer_fd < 0) {
+            std::cerr << "Error creating reconnect timer: " << strerror(errno) << std::endl;
+            return 1;
+        }
+    }
+
+    if (reconnect_timer_fd >= 0) {
+        reconnect_timer_handler = {reconnect_timer_fd, on_reconnect_timer, nullptr};
+        watch_fd(&reconnect_timer_handler, EPOLLIN);
+    }
+    pair_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (pair_timer_fd < 0) {
+        std::cerr << "Error creating pairing timer: " << strerror(errno) << std::endl;
+        return 1;
+    }
+    pair_timer_handler = {pair_timer_fd, on_pair_timer, nullptr};
+    watch_fd(&pair_timer_handler, EPOLLIN);
+    listen_handler = {ctl_sock, on_listen_event, nullptr};
+    int_listen_handler = {int_sock, on_listen_event, nullptr};
+    watch_fd(&listen_handler, EPOLLIN);
+    watch_fd(&int_listen_handler, EPOLLIN);
+
+    std::cout << "Waiting for connections..." << std::endl;
+
+    // Main event loop. The registration set only changes when a device or
+    // host comes or goes; pending motion arms the report timer, so an idle
+    // link sleeps in epoll_wait without any timeout.
+    while (keep_running) {
+        if (trace_dump_requested) {
+            trace_dump_requested = 0;
+            dump_trace();
+        }
+
+        if (uring_active()) {
+            if (!uring_run_once()) break;
+        } else {
+            struct epoll_event evs[EPOLL_BATCH];
+            int ret = epoll_wait(epoll_fd, evs, EPOLL_BATCH, -1);
+            if (ret < 0) { if (errno == EINTR) continue; break; }
+            count(metrics.main_wakeups);
+
+            for (int i = 0; i < ret; ++i) {
+                fd_handler_t *handler = static_cast<fd_handler_t *>(evs[i].data.ptr);
+                handler->on_event(handler, evs[i].events);
+            }
+        }
+
+        reap_sessions();
+        arm_report_timer();
+    }
+    close_sessions();
+    uring_stop();
+
+    if (trace_enabled) dump_trace();
+    std::cout << "\nClosing listening sockets and cleaning up." << std::endl;
+    if (ctl_sock >= 0) close(ctl_sock);
+    if (int_sock >= 0) close(int_sock);
+    if (transport == &transport_unix) {
+        unlink((unix_path + ".ctl").c_str());
+        unlink((unix_path + ".int").c_str());
+    }
+    if (report_timer_fd >= 0) close(report_timer_fd);
+    if (replay_timer_fd >= 0) close(replay_timer_fd);
+    if (reconnect_timer_fd >= 0) close(reconnect_timer_fd);
+    if (remap_timer_fd >= 0) close(remap_timer_fd);
+    for (const half_open_t& h : half_open) close(h.ctl);
+    if (pair_timer_fd >= 0) close(pair_timer_fd);
+    for (const fd_handler_t& c : metrics_clients) close(c.fd);
+    if (metrics_sock >= 0) {
+        close(metrics_sock);
+        unlink(metrics_path.c_str());
+    }
+    if (inotify_fd >= 0) close(inotify_fd);
+    if (led_event_fd >= 0) close(led_event_fd);
+    if (threaded) {
+        close(device_epoll_fd);
+        close(ring_event_fd);
+        close(capture_stop_fd);
+    }
+    if (replay_events) munmap((void *)(reinterpret_cast<const capture_header_t *>(replay_events) - 1), replay_map_len);
+    if (record_file) fclose(record_file);
+    if (epoll_fd >= 0) close(epoll_fd);
+    return 0;
+}
@@ -0,0 +1,159 @@
+#include "bthid.h"
+
+// Reference host for the loopback transport: connects to <path>.ctl/.int,
+// checks every interrupt report against the layout the emulator advertises
+// (pass the same --hires/--nkro flags) and prints it with a decoding.
+// Exits non-zero if any report was malformed.
+bool host_boot = false;	// --boot: switch the emulator to the boot protocol first
+
+bool check_report(const unsigned char *rep, ssize_t len, std::string *text) {
+    char buf[128];
+    if (len < 2 || rep[0] != 0xA1) {
+        *text = "not an input report";
+        return false;
+    }
+
+    switch (report_kind(rep, host_boot)) {
+        case REPORTID_MOUSE: {
+            if (mouse_hires && !host_boot) {
+                if (len != sizeof(hidrep_mouse_hires_t)) break;
+                const hidrep_mouse_hires_t *m = reinterpret_cast<const hidrep_mouse_hires_t *>(rep);
+                snprintf(buf, sizeof(buf), "mouse buttons=%u x=%d y=%d wheel=%d hwheel=%d", m->button,
+                         (short)le16toh(m->axis_x), (short)le16toh(m->axis_y),
+                         (short)le16toh(m->wheel), (short)le16toh(m->hwheel));
+            } else {
+                if (len != sizeof(hidrep_mouse_t)) break;
+                const hidrep_mouse_t *m = reinterpret_cast<const hidrep_mouse_t *>(rep);
+                snprintf(buf, sizeof(buf), "mouse buttons=%u x=%d y=%d wheel=%d", m->button,
+                         m->axis_x, m->axis_y, m->axis_z);
+            }
+            *text = buf;
+            if (rep[2] & ~0x07) {
+                *text += " (undeclared button bits)";
+                return false;
+            }
+            return true;
+        }
+        case REPORTID_KEYBD: {
+            *text = "keyboard";
+            if (keyboard_nkro && !host_boot) {
+                if (len != sizeof(hidrep_keyb_nkro_t)) break;
+                const hidrep_keyb_nkro_t *k = reinterpret_cast<const hidrep_keyb_nkro_t *>(rep);
+                for (int u = 0; u <= 0xE7; ++u) {
+                    if (!keybit(k->bits, u)) continue;
+                    snprintf(buf, sizeof(buf), " %02X", u);
+                    *text += buf;
+                    if (u < 0x04) return false; // Reserved and error usages
+                }
+                return true;
+            }
+
+            if (len != sizeof(hidrep_keyb_t)) break;
+            const hidrep_keyb_t *k = reinterpret_cast<const hidrep_keyb_t *>(rep);
+            snprintf(buf, sizeof(buf), " mod=%02X keys", k->modify);
+            *text += buf;
+            bool ok = k->reserved == 0;
+            for (int i = 0; i < KEYB_SLOTS; ++i) {
+                snprintf(buf, sizeof(buf), " %02X", k->key[i]);
+                *text += buf;
+                // Slots are packed, unique, and hold no modifiers
+                if (i > 0 && k->key[i] && !k->key[i - 1]) ok = false;
+                if (k->key[i] >= 0xE0) ok = false;
+                if (k->key[i] > HID_ERR_ROLLOVER && memchr(k->key, k->key[i], i)) ok = false;
+            }
+            return ok;
+        }
+        case REPORTID_CONSUMER: {
+            if (host_boot || len != sizeof(hidrep_consumer_t)) break;
+            const hidrep_consumer_t *c = reinterpret_cast<const hidrep_consumer_t *>(rep);
+            snprintf(buf, sizeof(buf), "consumer usage=%03X", le16toh(c->usage));
+            *text = buf;
+            return le16toh(c->usage) <= 0x3FF;
+        }
+        case REPORTID_GAMEPAD: {
+            if (!gamepad || host_boot || len != sizeof(hidrep_gamepad_t)) break;
+            const hidrep_gamepad_t *g = reinterpret_cast<const hidrep_gamepad_t *>(rep);
+            snprintf(buf, sizeof(buf), "gamepad buttons=%04X hat=%u x=%d y=%d z=%d rz=%d brake=%u accel=%u",
+                     le16toh(g->buttons), g->hat, g->x, g->y, g->z, g->rz, g->brake, g->accel);
+            *text = buf;
+            // The hat nibble's padding is constant, -128 is outside the logical range
+            return g->hat <= GAMEPAD_HAT_NULL && g->x != -128 && g->y != -128 && g->z != -128 && g->rz != -128;
+        }
+        default:
+            *text = "unknown report id";
+            return false;
+    }
+
+    snprintf(buf, sizeof(buf), "bad length %zd for report id %u", len, rep[1]);
+    *text = buf;
+    return false;
+}
+
+// Checks that a control request was acknowledged
+bool host_handshake(int ctl) {
+    unsigned char reply[64];
+    if (recv(ctl, reply, sizeof(reply), 0) < 1) {
+        std::cerr << "No answer to a control request: " << strerror(errno) << std::endl;
+        return false;
+    }
+    if (reply[0] != (HIDP_HANDSHAKE | HIDP_HSHK_SUCCESS)) {
+        fprintf(stderr, "Control request answered with %02X\n", reply[0]);
+        return false;
+    }
+    return true;
+}
+
+int run_reference_host(const std::string& path) {
+    int ctl = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    int intr = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    struct sockaddr_un addr;
+
+    if (ctl < 0 || intr < 0 ||
+        !unix_addr(path + ".ctl", &addr) || connect(ctl, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        std::cerr << "Could not connect to emulator at " << path << ": " << strerror(errno) << std::endl;
+        return 1;
+    }
+
+    // Set the emulator up like a real host does while connecting; the
+    // protocol switch is in place before the first input report
+    unsigned char set_protocol = HIDP_SET_PROTOCOL | HIDP_PROTOCOL_BOOT;
+    unsigned char set_leds[3] = { HIDP_SET_REPORT | HIDP_REPORT_OUTPUT, keyb_report_id(host_boot), 0x02 }; // Caps Lock
+    if (host_boot) send(ctl, &set_protocol, 1, MSG_NOSIGNAL);
+    send(ctl, set_leds, sizeof(set_leds), MSG_NOSIGNAL);
+
+    if (!unix_addr(path + ".int", &addr) || connect(intr, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        std::cerr << "Could not connect to emulator at " << path << ": " << strerror(errno) << std::endl;
+        return 1;
+    }
+
+    uint64_t reports = 0, bad = 0;
+    if (host_boot && !host_handshake(ctl)) bad++;
+    if (!host_handshake(ctl)) bad++;
+
+    unsigned char rep[64];
+    ssize_t len;
+    while (keep_running && (len = recv(intr, rep, sizeof(rep), 0)) != 0) {
+        if (len < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        std::string text;
+        bool ok = check_report(rep, len, &text);
+        reports++;
+        if (!ok) bad++;
+
+        char hex[4];
+        for (ssize_t i = 0; i < len; ++i) {
+            snprintf(hex, sizeof(hex), "%02X ", rep[i]);
+            std::cout << hex;
+        }
+        std::cout << (ok ? " " : " INVALID ") << text << "\n";
+    }
+    std::cout.flush();
+
+    std::cerr << "Host: " << reports << " reports, " << bad << " invalid" << std::endl;
+    close(ctl);
+    close(intr);
+    return bad ? 1 : 0;
+}
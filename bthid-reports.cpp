@@ -0,0 +1,1149 @@
+// Input state and the event -> report pipeline: descriptors, keymap,
+// pointer curves, gamepad scaling, the frame encoder, the send queue and
+// the remap engine. Linked by the emulator, its tests and its benchmark.
+#include "bthid.h"
+
+// State for HID reports
+char mousebuttons = 0;
+// Keyboard state, one bit per HID usage. Usages 0xE0-0xE7 are the
+// modifiers, so keybits[0xE0 / 8] doubles as the modifier byte.
+unsigned char keybits[32] = { 0 };
+bool keyboard_nkro = false;	// Report format, chosen at startup
+unsigned short consumerkey = 0;
+// Pointer motion in Q16.16 counts, after the device's curve. The fraction
+// is what did not fit in a report yet and carries over exactly.
+int64_t dx = 0, dy = 0;
+int dz = 0;			// Wheels in 1/WHEEL_UNIT detents
+int dh = 0;			// Horizontal wheel, only reported in hi-res mode
+bool wheel_hires_seen = false;	// A device sends REL_WHEEL_HI_RES, ignore its REL_WHEEL
+bool hwheel_hires_seen = false;
+
+pointer_curve_t default_curve = { "", 1.0, 0.0, POINTER_THRESHOLD_DEFAULT, {} };
+std::list<pointer_curve_t> pointer_curves;	// per-device curves, first match wins
+// Curve of each device by event_device_t::index, which captures keep as a byte
+std::array<const pointer_curve_t *, 256> device_curves;
+
+// Raw counts of the frame being read and the curve they will go through
+int frame_rx = 0, frame_ry = 0;
+const pointer_curve_t *frame_curve = &default_curve;
+
+void build_pointer_curve(pointer_curve_t *c) {
+    for (int speed = 0; speed < POINTER_LUT_SIZE; ++speed) {
+        double gain = c->sensitivity * (1.0 + c->accel * std::max(0, speed - c->threshold));
+        c->gain[speed] = static_cast<int32_t>(lround(std::min(gain, (double)POINTER_GAIN_MAX) * POINTER_ONE));
+    }
+}
+
+// Parses [MATCH=]SENS[,ACCEL[,THRESHOLD]]
+bool add_pointer_curve(const char *spec) {
+    pointer_curve_t c = { "", 1.0, 0.0, POINTER_THRESHOLD_DEFAULT, {} };
+    const char *eq = strrchr(spec, '=');
+    if (eq) {
+        c.match.assign(spec, eq - spec);
+        spec = eq + 1;
+    }
+    char *end;
+    c.sensitivity = strtod(spec, &end);
+    if (*end == ',') c.accel = strtod(end + 1, &end);
+    if (*end == ',') c.threshold = strtol(end + 1, &end, 10);
+    if (*end || c.sensitivity <= 0 || c.accel < 0 || c.threshold < 0) return false;
+    build_pointer_curve(&c);
+    if (!eq || c.match.empty()) default_curve = c;
+    else pointer_curves.push_back(c);
+    return true;
+}
+
+const pointer_curve_t *pointer_curve_for(const char *name, const std::string& path) {
+    for (const pointer_curve_t& c : pointer_curves) {
+        if (strstr(name, c.match.c_str()) || path == c.match) return &c;
+    }
+    return &default_curve;
+}
+
+// Moves the frame's raw counts through its curve into the accumulators. The
+// speed is an octagonal estimate of the frame's length, max + min / 2.
+inline void apply_pointer_frame() {
+    if (!frame_rx && !frame_ry) return;
+    int ax = abs(frame_rx), ay = abs(frame_ry);
+    int speed = std::max(ax, ay) + std::min(ax, ay) / 2;
+    int64_t gain = frame_curve->gain[std::min(speed, POINTER_LUT_SIZE - 1)];
+    dx += frame_rx * gain;
+    dy += frame_ry * gain;
+    frame_rx = frame_ry = 0;
+}
+
+// Whole counts of a Q16.16 value, rounded down like floor()
+inline int64_t pointer_counts(int64_t v) {
+    return v >> POINTER_FRAC_BITS;
+}
+
+bool gamepad = false;
+int pad_deadzone_pct = -1;		// --deadzone, -1 uses the device's flat value
+// By event_device_t::index. Captures carry no axis ranges, so replayed
+// devices keep the default: an xpad style controller.
+pad_calib_t pad_calibs[256];
+unsigned short padbuttons = 0;
+unsigned char paddpad = 0;		// BTN_DPAD_UP/DOWN/LEFT/RIGHT as bits 0-3
+int pad_hat_x = 0, pad_hat_y = 0;	// ABS_HAT0X/Y, -1, 0 or 1
+int pad_axes[PAD_AXES] = { 0 };
+
+// An xpad style controller: 16-bit sticks, 8-bit triggers on ABS_Z/ABS_RZ
+void default_pad_calib(pad_calib_t *c) {
+    memset(c->slot, -1, sizeof(c->slot));
+    c->slot[ABS_X] = PAD_X;
+    c->slot[ABS_Y] = PAD_Y;
+    c->slot[ABS_RX] = PAD_Z;
+    c->slot[ABS_RY] = PAD_RZ;
+    c->slot[ABS_Z] = c->slot[ABS_BRAKE] = PAD_BRAKE;
+    c->slot[ABS_RZ] = c->slot[ABS_GAS] = PAD_ACCEL;
+    for (int a = PAD_X; a <= PAD_RZ; ++a) {
+        int32_t flat = pad_deadzone_pct >= 0 ? 32767 * pad_deadzone_pct / 100 : 128;
+        c->axis[a] = { 0, flat, 32767 - flat, 127 };
+    }
+    c->axis[PAD_BRAKE] = c->axis[PAD_ACCEL] = { 0, 0, 255, 255 };
+}
+
+// Reads the axis ranges of a grabbed gamepad. Pads without ABS_RX put the
+// right stick on ABS_Z/ABS_RZ, where others have their triggers.
+void calibrate_pad(int fd, pad_calib_t *c) {
+    unsigned long absbits[ABS_MAX / (8 * sizeof(unsigned long)) + 1] = { 0 };
+    ioctl(fd, EVIOCGBIT(EV_ABS, sizeof(absbits)), absbits);
+    auto has = [&absbits](int code) { return (absbits[code / (8 * sizeof(unsigned long))] >> (code % (8 * sizeof(unsigned long)))) & 1; };
+
+    default_pad_calib(c);
+    if (!has(ABS_RX)) {
+        c->slot[ABS_Z] = PAD_Z;
+        c->slot[ABS_RZ] = PAD_RZ;
+    }
+    for (int code = 0; code < ABS_CNT; ++code) {
+        struct input_absinfo info;
+        int slot = c->slot[code];
+        if (slot < 0 || !has(code) || ioctl(fd, EVIOCGABS(code), &info) < 0 || info.maximum <= info.minimum) continue;
+
+        pad_axis_calib_t& a = c->axis[slot];
+        if (slot <= PAD_RZ) {
+            int32_t half = (info.maximum - info.minimum) / 2;
+            a.center = info.minimum + half + ((info.maximum - info.minimum) & 1);
+            a.flat = pad_deadzone_pct >= 0 ? half * pad_deadzone_pct / 100 : info.flat;
+            a.span = std::max(1, half - a.flat);
+            a.out_max = 127;
+        } else {
+            a.center = info.minimum;
+            a.flat = info.flat;
+            a.span = std::max(1, info.maximum - info.minimum - a.flat);
+            a.out_max = 255;
+        }
+    }
+}
+
+// Mouse report format, chosen at startup. The hi-res report is one packet
+// for any realistic flick; the 8-bit boot-like report stays for hosts that
+// cannot parse it.
+bool mouse_hires = false;
+
+// Whether the host with focus gets the hi-res layout, the only one with a
+// horizontal wheel; a boot protocol host gets the 8-bit report
+inline bool hires_layout() {
+    return mouse_hires && focus && !focus->boot_protocol;
+}
+
+// Wheel accumulator units that make up one unit in the report sent to focus
+inline int wheel_step() {
+    return hires_layout() ? WHEEL_UNIT / focus->wheel_multiplier : WHEEL_UNIT;
+}
+// With several hosts connected this key moves input to the next one
+int switch_key = KEY_SCROLLLOCK;
+std::string hid_descriptor;
+
+// Report scheduler. Motion is flushed on deadlines aligned to a grid of
+// 1/report_rate_hz on CLOCK_MONOTONIC; a rate of 0 flushes on every SYN_REPORT.
+int report_rate_hz = REPORT_RATE_DEFAULT;
+int report_timer_fd = -1;
+bool report_timer_armed = false;
+fd_handler_t report_timer_handler;
+
+// Measured spacing of back-to-back scheduled reports against the nominal period
+struct report_jitter_t {
+	uint64_t	last_ns;	// previous scheduled send, 0 when the chain is broken
+	uint64_t	intervals;
+	uint64_t	missed_ticks;	// timer expirations we were too late to serve
+	uint64_t	sum_dev_ns;
+	uint64_t	max_dev_ns;
+};
+report_jitter_t report_jitter = {};
+
+// Copies one encoded descriptor collection into the SDP descriptor blob
+template <size_t N>
+std::string descriptor_part(const std::array<unsigned char, N>& bytes) {
+    return std::string(reinterpret_cast<const char *>(bytes.data()), N);
+}
+
+std::string build_hid_descriptor() {
+    std::string desc = mouse_hires ? descriptor_part(HID_MOUSE_HIRES_BYTES) : descriptor_part(HID_MOUSE_BYTES);
+    desc += keyboard_nkro ? descriptor_part(HID_KEYBD_NKRO_BYTES) : descriptor_part(HID_KEYBD_BYTES);
+    desc += descriptor_part(HID_CONSUMER_BYTES);
+    if (gamepad) desc += descriptor_part(HID_GAMEPAD_BYTES);
+    return desc;
+}
+
+// Keycode for a keymap name, with or without the KEY_ prefix; -1 if unknown
+int key_by_name(const char *name) {
+    if (strncasecmp(name, "KEY_", 4) == 0) name += 4;
+    for (const keymap_entry_t& entry : keymap) {
+        if (strcasecmp(entry.name + 4, name) == 0) return entry.code;
+    }
+    return -1;
+}
+
+report_stats_t report_stats = {};
+bool keyb_dirty = false, mouse_dirty = false, consumer_dirty = false, gamepad_dirty = false;
+
+// Encodes a keyboard bitmap in the given protocol's format, returns its length
+size_t encode_keyb_report(keyb_report_u *rep, const unsigned char *bits, bool boot) {
+    if (keyboard_nkro && !boot) {
+        rep->nkro.btcode = 0xA1;
+        rep->nkro.rep_id = REPORTID_KEYBD;
+        memcpy(rep->nkro.bits, bits, NKRO_BYTES);
+        return sizeof(rep->nkro);
+    }
+
+    hidrep_keyb_t *evkeyb = &rep->boot;
+    evkeyb->btcode = 0xA1;
+    evkeyb->rep_id = keyb_report_id(boot);
+    evkeyb->modify = bits[0xE0 >> 3];
+    evkeyb->reserved = 0;
+    memset(evkeyb->key, 0, KEYB_SLOTS);
+
+    // Fill the slots in usage order, skipping empty bytes of the bitmap
+    int n = 0;
+    for (int byte = 0; byte < (0xE0 >> 3); ++byte) {
+        if (!bits[byte]) continue;
+        for (int bit = 0; bit < 8; ++bit) {
+            if (!(bits[byte] & (1 << bit))) continue;
+            if (n == KEYB_SLOTS) {
+                memset(evkeyb->key, HID_ERR_ROLLOVER, KEYB_SLOTS);
+                return sizeof(*evkeyb);
+            }
+            evkeyb->key[n++] = (byte << 3) | bit;
+        }
+    }
+    return sizeof(*evkeyb);
+}
+
+// Keyboard report of either format back to a usage bitmap
+void decode_keyb_report(const unsigned char *rep, size_t len, unsigned char *bits) {
+    memset(bits, 0, 32);
+    if (len == sizeof(hidrep_keyb_nkro_t)) {
+        memcpy(bits, rep + 2, NKRO_BYTES);
+        return;
+    }
+    const hidrep_keyb_t *k = reinterpret_cast<const hidrep_keyb_t *>(rep);
+    bits[0xE0 >> 3] = k->modify;
+    for (int i = 0; i < KEYB_SLOTS; ++i) {
+        if (k->key[i]) bits[k->key[i] >> 3] |= 1 << (k->key[i] & 7);
+    }
+}
+
+inline bool fits_axis(int v, bool hires) {
+    return hires ? (v >= -32767 && v <= 32767) : (v >= -127 && v <= 127);
+}
+
+// Adds the motion of a mouse report to a queued one with the same buttons
+bool merge_mouse_report(unsigned char *dst, const unsigned char *src, size_t len) {
+    if (len == sizeof(hidrep_mouse_hires_t)) {
+        hidrep_mouse_hires_t *a = reinterpret_cast<hidrep_mouse_hires_t *>(dst);
+        const hidrep_mouse_hires_t *b = reinterpret_cast<const hidrep_mouse_hires_t *>(src);
+        int sum[4] = { (short)le16toh(a->axis_x) + (short)le16toh(b->axis_x),
+                       (short)le16toh(a->axis_y) + (short)le16toh(b->axis_y),
+                       (short)le16toh(a->wheel) + (short)le16toh(b->wheel),
+                       (short)le16toh(a->hwheel) + (short)le16toh(b->hwheel) };
+        if (a->button != b->button) return false;
+        for (int v : sum) if (!fits_axis(v, true)) return false;
+        a->axis_x = htole16(sum[0]);
+        a->axis_y = htole16(sum[1]);
+        a->wheel = htole16(sum[2]);
+        a->hwheel = htole16(sum[3]);
+        return true;
+    }
+
+    hidrep_mouse_t *a = reinterpret_cast<hidrep_mouse_t *>(dst);
+    const hidrep_mouse_t *b = reinterpret_cast<const hidrep_mouse_t *>(src);
+    int sum[3] = { a->axis_x + b->axis_x, a->axis_y + b->axis_y, a->axis_z + b->axis_z };
+    if (a->button != b->button) return false;
+    for (int v : sum) if (!fits_axis(v, false)) return false;
+    a->axis_x = sum[0];
+    a->axis_y = sum[1];
+    a->axis_z = sum[2];
+    return true;
+}
+
+// Tries to fold a report into the newest queued one. Only the tail is
+// considered so reports of different kinds keep their order. A keyboard
+// report may replace the queued one when every key that one changed
+// still reads the same, so a tap queued as press and release survives.
+bool merge_queued_report(host_session_t *s, const unsigned char *rep, size_t len) {
+    queued_report_t& tail = s->send_queue.back();
+    if (tail.len != len || tail.data[1] != rep[1]) return false;
+
+    switch (report_kind(rep, s->boot_protocol)) {
+        case REPORTID_MOUSE:
+            return merge_mouse_report(tail.data, rep, len);
+        case REPORTID_KEYBD: {
+            unsigned char queued[32], next[32];
+            decode_keyb_report(tail.data, len, queued);
+            decode_keyb_report(rep, len, next);
+            for (int i = 0; i < 32; ++i) {
+                if ((tail.keys_before[i] ^ queued[i]) & (queued[i] ^ next[i])) return false;
+            }
+            memcpy(tail.data, rep, len);
+            return true;
+        }
+        case REPORTID_GAMEPAD:
+            // Axes are absolute: the newer report wins unless a button or the hat changed
+            if (memcmp(tail.data + 2, rep + 2, 3) != 0) return false;
+            memcpy(tail.data, rep, len);
+            return true;
+    }
+    return false;
+}
+
+void queue_report(host_session_t *s, const void *rep, size_t len) {
+    const unsigned char *bytes = static_cast<const unsigned char *>(rep);
+    if (!s->send_queue.empty() && merge_queued_report(s, bytes, len)) {
+        count(metrics.merged);
+        return;
+    }
+
+    // Full: a report overwrites the newest of its kind instead
+    if (s->send_queue.size() >= SEND_QUEUE_MAX) {
+        for (auto it = s->send_queue.rbegin(); it != s->send_queue.rend(); ++it) {
+            if (it->len == len && it->data[1] == bytes[1]) {
+                memcpy(it->data, bytes, len);
+                count(metrics.merged);
+                return;
+            }
+        }
+    }
+
+    queued_report_t q;
+    memcpy(q.data, bytes, len);
+    q.len = len;
+    memcpy(q.keys_before, s->accepted_keys, sizeof(s->accepted_keys));
+    s->send_queue.push_back(q);
+    count(metrics.queued);
+    report_stats.max_depth = std::max(report_stats.max_depth, s->send_queue.size());
+}
+
+void link_lost(host_session_t *s, const char *what) {
+    // The main loop decides whether to reconnect
+    if (s->up) std::cerr << "Host " << s->number << ": " << what << ": " << strerror(errno) << std::endl;
+    s->up = false;
+}
+
+// The backlog cleared: motion held back meanwhile goes out now, or at the
+// next tick when reports are paced
+void backlog_cleared(host_session_t *s) {
+    if (s == focus && s->up && !report_timer_armed) send_pending_reports();
+}
+
+// Congested: hold reports back until the socket drains
+void begin_stall(host_session_t *s) {
+    count(metrics.stalls);
+    s->stall_start_ns = monotonic_ns();
+    s->draining = true;
+    watch_fd_events(&s->int_handler, EPOLLIN | EPOLLRDHUP | EPOLLOUT);
+}
+
+// Returns false only when the link is gone; a report queued behind a
+// congested link counts as accepted
+bool send_report(host_session_t *s, const void *rep, size_t len) {
+    const unsigned char *bytes = static_cast<const unsigned char *>(rep);
+    if (!s->up) return false;
+
+    if (send_backlogged(s)) {
+        queue_report(s, rep, len);
+        if (trace_enabled) trace_pending = {}; // Its send time is not known yet
+    } else if (uring_active()) {
+        // Goes out with the next io_uring_enter(); out of buffers, it waits
+        // in send_queue behind them
+        if (!uring_queue_send(s, bytes, len)) {
+            queue_report(s, rep, len);
+            if (trace_enabled) trace_pending = {};
+        }
+    } else {
+        uint64_t start = trace_enabled ? monotonic_ns() : 0;
+        report_stats.send_calls++;
+        if (send(s->intr, rep, len, MSG_NOSIGNAL) < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                count(metrics.send_errors);
+                link_lost(s, "Send failed");
+                return false;
+            }
+            begin_stall(s);
+            queue_report(s, rep, len);
+            if (trace_enabled) trace_pending = {};
+        } else {
+            report_stats.sent++;
+            count(metrics.reports_sent[report_kind(bytes, s->boot_protocol) & 7]);
+            if (trace_enabled) trace_report_sent(start);
+        }
+    }
+
+    if (report_kind(bytes, s->boot_protocol) == REPORTID_KEYBD) decode_keyb_report(bytes, len, s->accepted_keys);
+    return true;
+}
+
+// EPOLLOUT on the interrupt channel: sends what fits, stops watching once empty
+void drain_send_queue(host_session_t *s) {
+    while (!s->send_queue.empty()) {
+        const queued_report_t& q = s->send_queue.front();
+        report_stats.send_calls++;
+        if (send(s->intr, q.data, q.len, MSG_NOSIGNAL) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            count(metrics.send_errors);
+            link_lost(s, "Send failed");
+            return;
+        }
+        report_stats.sent++;
+        count(metrics.reports_sent[report_kind(q.data, s->boot_protocol) & 7]);
+        s->send_queue.pop_front();
+    }
+
+    uint64_t stalled = monotonic_ns() - s->stall_start_ns;
+    count(metrics.stall_ns, stalled);
+    report_stats.stall_max_ns = std::max(report_stats.stall_max_ns, stalled);
+    s->draining = false;
+    watch_fd_events(&s->int_handler, EPOLLIN | EPOLLRDHUP);
+    if (!s->uring_inflight) backlog_cleared(s);
+}
+
+// Before an orderly close: give queued reports a last chance to go out
+void flush_send_queue(host_session_t *s, int timeout_ms) {
+    uring_settle();
+    struct pollfd pfd = { s->intr, POLLOUT, 0 };
+    while (s->up && !s->send_queue.empty() && poll(&pfd, 1, timeout_ms) > 0) {
+        drain_send_queue(s);
+    }
+}
+
+// Encodes a mouse report with the given buttons and no motion
+size_t encode_mouse_report(unsigned char *buf, unsigned char buttons, bool boot) {
+    if (mouse_hires && !boot) {
+        mouse_layout<hidrep_mouse_hires_t>::pack(reinterpret_cast<hidrep_mouse_hires_t *>(buf), REPORTID_MOUSE, buttons, 0, 0, 0, 0);
+        return sizeof(hidrep_mouse_hires_t);
+    }
+    mouse_layout<hidrep_mouse_t>::pack(reinterpret_cast<hidrep_mouse_t *>(buf), mouse_report_id(boot), buttons, 0, 0, 0, 0);
+    return sizeof(hidrep_mouse_t);
+}
+
+// Hat switch value for a d-pad direction, y pointing down
+inline unsigned char pad_hat(int x, int y) {
+    static const unsigned char hat[3][3] = { { 7, 0, 1 }, { 6, GAMEPAD_HAT_NULL, 2 }, { 5, 4, 3 } };
+    return hat[y + 1][x + 1];
+}
+
+// The gamepad report for the current state, or a centred one
+void encode_gamepad_report(hidrep_gamepad_t *rep, bool current) {
+    memset(rep, 0, sizeof(*rep));
+    rep->btcode = 0xA1;
+    rep->rep_id = REPORTID_GAMEPAD;
+    rep->hat = GAMEPAD_HAT_NULL;
+    if (!current) return;
+
+    int x = pad_hat_x + ((paddpad >> 3) & 1) - ((paddpad >> 2) & 1);
+    int y = pad_hat_y + ((paddpad >> 1) & 1) - (paddpad & 1);
+    rep->buttons = htole16(padbuttons);
+    rep->hat = pad_hat(std::max(-1, std::min(1, x)), std::max(-1, std::min(1, y)));
+    rep->x = pad_axes[PAD_X];
+    rep->y = pad_axes[PAD_Y];
+    rep->z = pad_axes[PAD_Z];
+    rep->rz = pad_axes[PAD_RZ];
+    rep->brake = pad_axes[PAD_BRAKE];
+    rep->accel = pad_axes[PAD_ACCEL];
+}
+
+// Scales a raw axis value. The position is worked out in quarter steps and
+// the value only moves once the input is 3/4 of a step away from it, so
+// noise around the edge between two steps cannot flip it back and forth.
+int quantize_axis(const pad_axis_calib_t& a, int32_t raw, int current) {
+    int64_t d = (int64_t)raw - a.center;
+    int64_t mag = (d < 0 ? -d : d) - a.flat;
+    if (mag <= 0) return 0;
+    int64_t quarters = std::min<int64_t>(mag * a.out_max * 4 / a.span, a.out_max * 4);
+    if (d < 0) quarters = -quarters;
+    if (std::abs(quarters - current * 4) < 3) return current;
+    return (int)((quarters + (quarters < 0 ? -2 : 2)) / 4);
+}
+
+void pad_abs_event(uint8_t device, int code, int value) {
+    if (code == ABS_HAT0X || code == ABS_HAT0Y) {
+        int dir = value < 0 ? -1 : value > 0;
+        int& hat = code == ABS_HAT0X ? pad_hat_x : pad_hat_y;
+        if (hat != dir) gamepad_dirty = true;
+        hat = dir;
+        return;
+    }
+    if ((unsigned)code >= ABS_CNT) return;
+    const pad_calib_t& c = pad_calibs[device];
+    int slot = c.slot[code];
+    if (slot < 0) return;
+    int v = quantize_axis(c.axis[slot], value, pad_axes[slot]);
+    if (v != pad_axes[slot]) gamepad_dirty = true;
+    pad_axes[slot] = v;
+}
+
+// The host starts out with nothing pressed
+void reset_report_history(host_session_t *s) {
+    static const unsigned char nothing[sizeof(keybits)] = { 0 };
+    s->last_keyb_len = encode_keyb_report(&s->last_keyb_report, nothing, s->boot_protocol);
+    s->last_mouse_buttons = 0;
+    s->last_consumer_usage = 0;
+    encode_gamepad_report(&s->last_gamepad_report, false);
+    memset(s->accepted_keys, 0, sizeof(s->accepted_keys));
+    s->send_queue.clear();
+    trace_pending = {};
+}
+
+// Sends whatever this host still holds as released
+void release_host_keys(host_session_t *s) {
+    static const unsigned char nothing[sizeof(keybits)] = { 0 };
+    keyb_report_u evkeyb;
+    size_t len = encode_keyb_report(&evkeyb, nothing, s->boot_protocol);
+    if (len != s->last_keyb_len || memcmp(&evkeyb, &s->last_keyb_report, len) != 0) {
+        if (send_report(s, &evkeyb, len)) {
+            s->last_keyb_report = evkeyb;
+            s->last_keyb_len = len;
+        }
+    }
+    if (s->last_consumer_usage && !s->boot_protocol) {
+        hidrep_consumer_t evconsumer = { 0xA1, REPORTID_CONSUMER, 0 };
+        if (send_report(s, &evconsumer, sizeof(evconsumer))) s->last_consumer_usage = 0;
+    }
+    if (s->last_mouse_buttons) {
+        unsigned char evmouse[sizeof(hidrep_mouse_hires_t)];
+        if (send_report(s, evmouse, encode_mouse_report(evmouse, 0, s->boot_protocol))) s->last_mouse_buttons = 0;
+    }
+    hidrep_gamepad_t evpad;
+    encode_gamepad_report(&evpad, false);
+    if (gamepad && !s->boot_protocol && memcmp(&evpad, &s->last_gamepad_report, sizeof(evpad)) != 0) {
+        if (send_report(s, &evpad, sizeof(evpad))) s->last_gamepad_report = evpad;
+    }
+}
+
+// Called at every SYN_REPORT: emits at most one keyboard report and one
+// mouse report (buttons plus whatever motion has accumulated) to the host
+// with focus, each only if its bytes differ from the last one that host
+// received. Each report is encoded once into a frame buffer and sent from
+// there.
+void flush_frame() {
+    if (trace_enabled) trace_frame_done();
+
+    if (!focus_up()) {
+        // No host to send to: keep tracking keys, drop motion
+        keyb_dirty = mouse_dirty = consumer_dirty = gamepad_dirty = false;
+        dx = dy = dz = dh = 0;
+        return;
+    }
+
+    host_session_t *s = focus;
+    if (keyb_dirty) {
+        keyb_report_u evkeyb;
+        size_t len = encode_keyb_report(&evkeyb, keybits, s->boot_protocol);
+        if (len != s->last_keyb_len || memcmp(&evkeyb, &s->last_keyb_report, len) != 0) {
+            if (send_report(s, &evkeyb, len)) {
+                s->last_keyb_report = evkeyb;
+                s->last_keyb_len = len;
+            }
+        } else {
+            count(metrics.suppressed);
+        }
+        keyb_dirty = false;
+    }
+
+    if (s->boot_protocol) consumer_dirty = false; // No consumer report to carry it
+    if (consumer_dirty) {
+        if (consumerkey != s->last_consumer_usage) {
+            hidrep_consumer_t evconsumer;
+            evconsumer.btcode = 0xA1;
+            evconsumer.rep_id = REPORTID_CONSUMER;
+            evconsumer.usage = htole16(consumerkey);
+            if (send_report(s, &evconsumer, sizeof(evconsumer))) s->last_consumer_usage = consumerkey;
+        } else {
+            count(metrics.suppressed);
+        }
+        consumer_dirty = false;
+    }
+
+    if (s->boot_protocol) gamepad_dirty = false;
+    if (gamepad_dirty) {
+        hidrep_gamepad_t evpad;
+        encode_gamepad_report(&evpad, true);
+        if (memcmp(&evpad, &s->last_gamepad_report, sizeof(evpad)) != 0) {
+            if (send_report(s, &evpad, sizeof(evpad))) s->last_gamepad_report = evpad;
+        } else {
+            count(metrics.suppressed);
+        }
+        gamepad_dirty = false;
+    }
+
+    if (mouse_dirty) {
+        if ((mousebuttons & 0x07) != s->last_mouse_buttons) {
+            send_pending_reports();
+        } else {
+            count(metrics.suppressed);
+        }
+        mouse_dirty = false;
+    }
+
+    if (report_rate_hz == 0) send_pending_reports();
+}
+
+// Updates the report state for a key going down (1) or up (0)
+void apply_key(int code, int value) {
+    switch (code) {
+        case BTN_LEFT:
+        case BTN_RIGHT:
+        case BTN_MIDDLE: {
+            char c = 1 << (code & 0x03);
+            mousebuttons &= (0x07 - c); 
+            if (value == 1) mousebuttons |= c;
+            mouse_dirty = true;
+            break;
+        }
+        default: {
+            if (gamepad && code >= BTN_SOUTH && code <= BTN_THUMBR) {
+                unsigned short bit = 1 << (code - BTN_SOUTH);
+                if (value == 1) padbuttons |= bit;
+                else padbuttons &= ~bit;
+                gamepad_dirty = true;
+                break;
+            }
+            if (gamepad && code >= BTN_DPAD_UP && code <= BTN_DPAD_RIGHT) {
+                unsigned char bit = 1 << (code - BTN_DPAD_UP);
+                if (value == 1) paddpad |= bit;
+                else paddpad &= ~bit;
+                gamepad_dirty = true;
+                break;
+            }
+
+            unsigned short consumer = map_key_to_consumer(code);
+            if (consumer != 0) {
+                if (value == 1) consumerkey = consumer;
+                else if (consumerkey == consumer) consumerkey = 0;
+                consumer_dirty = true;
+                break;
+            }
+
+            unsigned char hid_code = map_key_to_hid(code);
+            if (hid_code != 0) {
+                unsigned char bit = 1 << (hid_code & 7);
+                if (value == 1) keybits[hid_code >> 3] |= bit;  // Key Down
+                else keybits[hid_code >> 3] &= ~bit;            // Key Up
+                keyb_dirty = true;
+            }
+            break;
+        }
+    }
+}
+
+// Key remapping (--keymap). The config is compiled at startup into one
+// action table per layer, indexed by keycode, so a key event costs a table
+// lookup and a few branches and never allocates.
+std::vector<remap_layer_t> remap_layers;	// [0] is the base layer; empty without --keymap
+unsigned remap_layer_mask = 1;		// bit per layer held down, the base is always on
+const remap_action_t *remap_down[KEY_CNT];	// action each held key was pressed with
+
+// Tap-hold keys: one at a time is undecided until released, held past its
+// time or interrupted by another key
+int taphold_key = -1;
+uint64_t taphold_deadline_ns = 0;
+
+// Macros: each step is the codes of the keys pressed together followed by
+// 0, and each macro ends with an empty step. Steps are typed one frame
+// every MACRO_STEP_MS off the remap timer, so the event loop never waits.
+std::vector<uint16_t> macro_codes;
+std::vector<uint32_t> macro_start;	// macro index -> offset in macro_codes
+uint16_t macro_queue[MACRO_QUEUE];
+unsigned macro_queue_head = 0, macro_queue_len = 0;
+int macro_pos = -1;			// step being typed, -1 when idle
+bool macro_step_down = false;		// its keys are pressed
+uint64_t macro_next_ns = 0;
+int remap_timer_fd = -1;
+fd_handler_t remap_timer_handler;
+
+void arm_remap_timer() {
+    if (remap_timer_fd < 0) return;
+    uint64_t due = 0;
+    if (taphold_key >= 0) due = taphold_deadline_ns;
+    if (macro_pos >= 0 && (!due || macro_next_ns < due)) due = macro_next_ns;
+    struct itimerspec its = {};
+    its.it_value.tv_sec = due / 1000000000ULL;
+    its.it_value.tv_nsec = due % 1000000000ULL;
+    timerfd_settime(remap_timer_fd, TFD_TIMER_ABSTIME, &its, nullptr);
+}
+
+void resolve_taphold_as_hold() {
+    apply_key(remap_down[taphold_key]->hold, 1);
+    taphold_key = -1;
+}
+
+void start_next_macro() {
+    if (macro_pos >= 0 || macro_queue_len == 0) return;
+    macro_pos = macro_start[macro_queue[macro_queue_head]];
+    macro_queue_head = (macro_queue_head + 1) % MACRO_QUEUE;
+    macro_queue_len--;
+    macro_step_down = false;
+    macro_next_ns = monotonic_ns();
+}
+
+// Presses or releases the keys of the current step as a frame of its own
+void play_macro_step() {
+    if (!macro_codes[macro_pos]) {
+        macro_pos = -1;
+        start_next_macro();
+        return;
+    }
+    macro_step_down = !macro_step_down;
+    int pos = macro_pos;
+    for (; macro_codes[pos]; ++pos) apply_key(macro_codes[pos], macro_step_down);
+    flush_frame();
+    if (!macro_step_down) macro_pos = pos + 1;
+    macro_next_ns += MACRO_STEP_MS * 1000000ULL;
+}
+
+void on_remap_timer(fd_handler_t *handler, uint32_t events) {
+    uint64_t expirations;
+    if (read(handler->fd, &expirations, sizeof(expirations)) < 0) return;
+
+    uint64_t now = monotonic_ns();
+    if (taphold_key >= 0 && taphold_deadline_ns <= now) {
+        resolve_taphold_as_hold();
+        flush_frame();
+    }
+    if (macro_pos >= 0 && macro_next_ns <= now) play_macro_step();
+    arm_remap_timer();
+}
+
+// A physical key through the active layer. Releases use the action the
+// key was pressed with, whatever layer is active by then.
+void remap_key(int code, int value) {
+    if (value == 1) {
+        const remap_action_t *act = &remap_layers[31 - __builtin_clz(remap_layer_mask)][code];
+        if (taphold_key >= 0) resolve_taphold_as_hold(); // Another key while undecided
+        remap_down[code] = act;
+        switch (act->kind) {
+            case REMAP_KEY:
+                apply_key(act->code, 1);
+                break;
+            case REMAP_LAYER:
+                remap_layer_mask |= 1u << act->layer;
+                break;
+            case REMAP_TAPHOLD:
+                taphold_key = code;
+                taphold_deadline_ns = monotonic_ns() + act->hold_ms * 1000000ULL;
+                arm_remap_timer();
+                break;
+            case REMAP_MACRO:
+                if (macro_queue_len == MACRO_QUEUE) break; // Typing is far behind, drop it
+                macro_queue[(macro_queue_head + macro_queue_len++) % MACRO_QUEUE] = act->code;
+                start_next_macro();
+                arm_remap_timer();
+                break;
+            case REMAP_NONE:
+                break;
+        }
+        return;
+    }
+
+    const remap_action_t *act = remap_down[code];
+    if (!act) return; // Went down before the state was last cleared
+    remap_down[code] = nullptr;
+    switch (act->kind) {
+        case REMAP_KEY:
+            apply_key(act->code, 0);
+            break;
+        case REMAP_LAYER:
+            remap_layer_mask &= ~(1u << act->layer);
+            break;
+        case REMAP_TAPHOLD:
+            if (taphold_key == code) {
+                // Released in time: a tap, pressed and released in two frames
+                taphold_key = -1;
+                apply_key(act->code, 1);
+                flush_frame();
+                apply_key(act->code, 0);
+                arm_remap_timer();
+            } else {
+                apply_key(act->hold, 0);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+// A key edge that was lost with SYN_DROPPED. Only the state is brought
+// in line: a resync never types a macro, taps a tap-hold key or switches
+// focus. A tap-hold key found down is already past being a tap.
+void resync_key(int code, int value) {
+    if (code == switch_key) return;
+    if (remap_layers.empty()) {
+        apply_key(code, value);
+        return;
+    }
+
+    if (value) {
+        const remap_action_t *act = &remap_layers[31 - __builtin_clz(remap_layer_mask)][code];
+        remap_down[code] = act;
+        if (act->kind == REMAP_KEY) apply_key(act->code, 1);
+        else if (act->kind == REMAP_LAYER) remap_layer_mask |= 1u << act->layer;
+        else if (act->kind == REMAP_TAPHOLD) apply_key(act->hold, 1);
+        return;
+    }
+
+    const remap_action_t *act = remap_down[code];
+    if (!act) return;
+    remap_down[code] = nullptr;
+    if (act->kind == REMAP_KEY) {
+        apply_key(act->code, 0);
+    } else if (act->kind == REMAP_LAYER) {
+        remap_layer_mask &= ~(1u << act->layer);
+    } else if (act->kind == REMAP_TAPHOLD) {
+        if (taphold_key == code) {
+            taphold_key = -1;
+            arm_remap_timer();
+        } else {
+            apply_key(act->hold, 0);
+        }
+    }
+}
+
+void reset_remap_state() {
+    remap_layer_mask = 1;
+    std::fill(std::begin(remap_down), std::end(remap_down), nullptr);
+    taphold_key = -1;
+    macro_pos = -1;
+    macro_queue_len = 0;
+    arm_remap_timer();
+}
+
+// Zeroes the input state without telling anyone; used when the focus link drops
+void clear_input_state() {
+    memset(keybits, 0, sizeof(keybits));
+    mousebuttons = 0;
+    consumerkey = 0;
+    dx = dy = dz = dh = 0;
+    frame_rx = frame_ry = 0;
+    if (!remap_layers.empty()) reset_remap_state();
+    padbuttons = paddpad = 0;
+    pad_hat_x = pad_hat_y = 0;
+    memset(pad_axes, 0, sizeof(pad_axes));
+    keyb_dirty = mouse_dirty = consumer_dirty = gamepad_dirty = false;
+}
+
+// Reads and compiles the --keymap config. Lines, with # comments:
+//   map FROM TO                 FROM sends TO instead, or nothing for TO = none
+//   layer KEY NAME              layer NAME is active while KEY is held
+//   taphold KEY TAP HOLD [MS]   TAP when tapped, HOLD when held longer than
+//                               MS (default 200) or together with another key
+//   macro KEY STEP...           types the steps; a step is a key, or keys
+//                               joined with + to press together
+//   [NAME]                      the lines below apply to layer NAME
+// Keys are the names of the keymap table, with or without KEY_. Layers
+// start as a copy of the base layer, so unmapped keys fall through to it.
+bool load_keymap(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        std::cerr << "Could not open keymap " << path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    struct rule_t { int layer, key; remap_action_t act; };
+    std::vector<rule_t> rules;
+    std::vector<std::string> layer_names = { "" };
+    auto layer_index = [&layer_names](const char *name) {
+        for (size_t i = 0; i < layer_names.size(); ++i) {
+            if (layer_names[i] == name) return (int)i;
+        }
+        layer_names.push_back(name);
+        return (int)layer_names.size() - 1;
+    };
+
+    char line[512];
+    int lineno = 0, layer = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), f)) {
+        lineno++;
+        if (char *hash = strchr(line, '#')) *hash = '\0';
+        char *save;
+        std::vector<char *> tok;
+        for (char *t = strtok_r(line, " \t\r\n", &save); t; t = strtok_r(nullptr, " \t\r\n", &save)) {
+            tok.push_back(t);
+        }
+        if (tok.empty()) continue;
+
+        auto fail = [&](const std::string& msg) {
+            std::cerr << "keymap " << path << ":" << lineno << ": " << msg << std::endl;
+            ok = false;
+        };
+        auto key = [&](const char *name) {
+            int code = key_by_name(name);
+            if (code < 0) fail(std::string("unknown key ") + name);
+            return code;
+        };
+
+        size_t len = strlen(tok[0]);
+        if (tok[0][0] == '[' && tok[0][len - 1] == ']' && len > 2 && tok.size() == 1) {
+            tok[0][len - 1] = '\0';
+            layer = layer_index(tok[0] + 1);
+            continue;
+        }
+
+        rule_t r = { layer, -1, { REMAP_KEY, 0, 0, 0, 0 } };
+        if (strcmp(tok[0], "map") == 0 && tok.size() == 3) {
+            r.key = key(tok[1]);
+            if (strcasecmp(tok[2], "none") == 0) r.act.kind = REMAP_NONE;
+            else r.act.code = key(tok[2]);
+        } else if (strcmp(tok[0], "layer") == 0 && tok.size() == 3) {
+            r.key = key(tok[1]);
+            r.act.kind = REMAP_LAYER;
+            r.act.layer = layer_index(tok[2]);
+        } else if (strcmp(tok[0], "taphold") == 0 && (tok.size() == 4 || tok.size() == 5)) {
+            r.key = key(tok[1]);
+            r.act.kind = REMAP_TAPHOLD;
+            r.act.code = key(tok[2]);
+            r.act.hold = key(tok[3]);
+            char *end = nullptr;
+            long ms = tok.size() == 5 ? strtol(tok[4], &end, 10) : TAPHOLD_MS_DEFAULT;
+            if ((end && *end) || ms < 1 || ms > TAPHOLD_MS_MAX) fail("bad tap-hold time");
+            r.act.hold_ms = ms;
+        } else if (strcmp(tok[0], "macro") == 0 && tok.size() >= 3) {
+            r.key = key(tok[1]);
+            r.act.kind = REMAP_MACRO;
+            r.act.code = macro_start.size();
+            macro_start.push_back(macro_codes.size());
+            for (size_t i = 2; i < tok.size(); ++i) {
+                char *save_step;
+                for (char *k = strtok_r(tok[i], "+", &save_step); k; k = strtok_r(nullptr, "+", &save_step)) {
+                    macro_codes.push_back(key(k));
+                }
+                macro_codes.push_back(0);
+            }
+            macro_codes.push_back(0);
+        } else {
+            fail(std::string("cannot parse '") + tok[0] + "' line");
+        }
+        if (ok && r.key == switch_key) fail("the switch key cannot be remapped");
+        if (ok) rules.push_back(r);
+    }
+    fclose(f);
+    if (ok && layer_names.size() > REMAP_LAYERS_MAX) {
+        std::cerr << "keymap " << path << ": more than " << REMAP_LAYERS_MAX << " layers" << std::endl;
+        ok = false;
+    }
+    if (!ok) return false;
+
+    remap_layers.resize(layer_names.size());
+    for (int code = 0; code < KEY_CNT; ++code) {
+        remap_layers[0][code] = { REMAP_KEY, 0, (uint16_t)code, 0, 0 };
+    }
+    for (size_t l = 0; l < remap_layers.size(); ++l) {
+        if (l) remap_layers[l] = remap_layers[0];
+        for (const rule_t& r : rules) {
+            if (r.layer == (int)l) remap_layers[l][r.key] = r.act;
+        }
+    }
+    std::cout << "Keymap: " << rules.size() << " rules in " << remap_layers.size() << " layers, "
+              << macro_start.size() << " macros." << std::endl;
+    return true;
+}
+
+void process_one_event(struct input_event *inevent, uint8_t device) {
+    switch (inevent->type) {
+        case EV_KEY: {
+            if (inevent->value & KEY_RESYNC) {
+                resync_key(inevent->code, inevent->value & 1);
+                break;
+            }
+            if (inevent->value == 2) break; // Autorepeat, the host repeats on its own
+            if (inevent->code == switch_key) {
+                if (inevent->value == 1) switch_focus(); // Never forwarded
+                break;
+            }
+
+            if (!remap_layers.empty()) remap_key(inevent->code, inevent->value);
+            else apply_key(inevent->code, inevent->value);
+            break;
+        }
+        case EV_REL: {
+            if (inevent->code == REL_X || inevent->code == REL_Y) {
+                const pointer_curve_t *curve = device_curves[device];
+                if (curve != frame_curve) {
+                    apply_pointer_frame();
+                    frame_curve = curve;
+                }
+                if (inevent->code == REL_X) frame_rx += inevent->value;
+                else frame_ry += inevent->value;
+            }
+            // Wheels accumulate in 1/120 detents; hi-res capable devices also
+            // send the coarse event, which would otherwise count twice
+            switch (inevent->code) {
+                case REL_WHEEL_HI_RES:
+                    wheel_hires_seen = true;
+                    dz += inevent->value;
+                    break;
+                case REL_WHEEL:
+                    if (!wheel_hires_seen) dz += inevent->value * WHEEL_UNIT;
+                    break;
+                case REL_HWHEEL_HI_RES:
+                    hwheel_hires_seen = true;
+                    if (hires_layout()) dh += inevent->value;
+                    break;
+                case REL_HWHEEL:
+                    if (hires_layout() && !hwheel_hires_seen) dh += inevent->value * WHEEL_UNIT;
+                    break;
+            }
+            break;
+        }
+        case EV_ABS: {
+            if (gamepad) pad_abs_event(device, inevent->code, inevent->value);
+            break;
+        }
+        case EV_SYN: {
+            if (inevent->code == SYN_REPORT) {
+                apply_pointer_frame();
+                flush_frame();
+            }
+            break;
+        }
+    }
+}
+
+// Whether the accumulators hold enough for send_pending_reports() to send,
+// judged by the layout and wheel divisor it will use
+bool motion_pending() {
+    return std::abs(dx) >= POINTER_ONE || std::abs(dy) >= POINTER_ONE ||
+           abs(dz) >= wheel_step() || (hires_layout() && abs(dh) >= wheel_step());
+}
+
+// Motion and buttons in layout R. One report carries up to the descriptor's
+// limit per axis, so this normally runs once; a button change rides along
+// in the first report even without movement. Behind a send backlog only a
+// button change is encoded, so a click survives; motion stays in the
+// accumulators until backlog_cleared().
+template <typename R>
+void send_motion(host_session_t *s, unsigned char id, int wheel_div) {
+    typedef mouse_layout<R> layout;
+    R evmouse;
+    unsigned char buttons = mousebuttons & 0x07;
+    bool buttons_changed = buttons != s->last_mouse_buttons;
+
+    while (motion_pending() || buttons_changed) {
+        if (send_backlogged(s) && !buttons_changed) break;
+
+        int x = hid_clamp(pointer_counts(dx), layout::xy);
+        int y = hid_clamp(pointer_counts(dy), layout::xy);
+        int v = hid_clamp(dz / wheel_div, layout::wheel);
+        int h = hid_clamp(dh / wheel_div, layout::hwheel);
+
+        // Only sub-count motion left: it waits for more instead of looping
+        if (x == 0 && y == 0 && v == 0 && h == 0 && !buttons_changed) {
+            break;
+        }
+
+        layout::pack(&evmouse, id, buttons, x, y, v, h);
+        if (!send_report(s, &evmouse, sizeof(evmouse))) {
+            return;
+        }
+        s->last_mouse_buttons = buttons;
+        buttons_changed = false;
+
+        // Subtract the sent values from the accumulators
+        dx -= (int64_t)x * POINTER_ONE;
+        dy -= (int64_t)y * POINTER_ONE;
+        dz -= v * wheel_div;
+        dh -= h * wheel_div;
+    }
+}
+
+// Motion and buttons go to the host with focus
+void send_pending_reports() {
+    if (!focus_up()) return;
+    host_session_t *s = focus;
+    if (hires_layout()) {
+        send_motion<hidrep_mouse_hires_t>(s, REPORTID_MOUSE, wheel_step());
+    } else {
+        send_motion<hidrep_mouse_t>(s, mouse_report_id(s->boot_protocol), WHEEL_UNIT);
+    }
+}
+
+// Starts the periodic report timer on the next slot of the rate grid
+void arm_report_timer() {
+    if (report_timer_armed || report_rate_hz == 0 || !motion_pending()) return;
+
+    uint64_t period = 1000000000ULL / report_rate_hz;
+    uint64_t deadline = (monotonic_ns() / period + 1) * period;
+
+    struct itimerspec its = {};
+    its.it_value.tv_sec = deadline / 1000000000ULL;
+    its.it_value.tv_nsec = deadline % 1000000000ULL;
+    its.it_interval.tv_nsec = period;
+    if (timerfd_settime(report_timer_fd, TFD_TIMER_ABSTIME, &its, nullptr) == 0) {
+        report_timer_armed = true;
+    }
+}
+
+void disarm_report_timer() {
+    struct itimerspec its = {};
+    timerfd_settime(report_timer_fd, 0, &its, nullptr);
+    report_timer_armed = false;
+    report_jitter.last_ns = 0;
+}
+
+void on_report_timer(fd_handler_t *handler, uint32_t events) {
+    uint64_t expirations = 0;
+    if (read(handler->fd, &expirations, sizeof(expirations)) != sizeof(expirations)) return;
+
+    if (!motion_pending()) {
+        disarm_report_timer();
+        return;
+    }
+
+    uint64_t now = monotonic_ns();
+    uint64_t period = 1000000000ULL / report_rate_hz;
+    if (expirations > 1) {
+        report_jitter.missed_ticks += expirations - 1;
+        report_jitter.last_ns = 0;
+    }
+    if (report_jitter.last_ns) {
+        uint64_t interval = now - report_jitter.last_ns;
+        uint64_t dev = interval > period ? interval - period : period - interval;
+        report_jitter.intervals++;
+        report_jitter.sum_dev_ns += dev;
+        report_jitter.max_dev_ns = std::max(report_jitter.max_dev_ns, dev);
+    }
+    report_jitter.last_ns = now;
+
+    send_pending_reports();
+}
+
+void print_report_jitter() {
+    if (report_rate_hz == 0) return;
+    std::cout << "Report timing at " << report_rate_hz << " Hz: " << report_jitter.intervals << " intervals";
+    if (report_jitter.intervals) {
+        std::cout << ", mean jitter " << report_jitter.sum_dev_ns / report_jitter.intervals / 1000.0 << " us"
+                  << ", max jitter " << report_jitter.max_dev_ns / 1000.0 << " us";
+    }
+    std::cout << ", " << report_jitter.missed_ticks << " missed ticks" << std::endl;
+}
+
+void print_report_stats() {
+    std::cout << "Reports: " << report_stats.sent << " sent, "
+              << metrics.suppressed.load() << " suppressed as unchanged" << std::endl;
+    if (!metrics.stalls.load()) return;
+    std::cout << "Congestion: " << metrics.stalls.load() << " stalls, "
+              << metrics.stall_ns.load() / 1000000 << " ms total, "
+              << report_stats.stall_max_ns / 1000000 << " ms longest; "
+              << metrics.queued.load() << " reports queued (at most " << report_stats.max_depth
+              << " at once), " << metrics.merged.load() << " merged" << std::endl;
+}
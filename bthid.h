@@ -0,0 +1,1004 @@
+// Shared by the emulator core (libbthid_core), the emulator, its tests and
+// its benchmark. Nothing in here needs the Bluetooth libraries.
+#ifndef BTHID_H
+#define BTHID_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <cerrno>
+#include <cstring>
+#include <cstdarg>
+#include <strings.h>
+#include <csignal>
+#include <dirent.h>
+#include <algorithm> // Required for std::min/std::max
+#include <cmath> // Required for round()
+#include <array>
+#include <map>
+#include <list>
+#include <deque>
+#include <atomic>
+#include <thread>
+
+#include <linux/input.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#ifdef WITH_IO_URING
+#include <linux/io_uring.h>
+#endif
+#include <cstdio>
+#include <cstdint>
+#include <endian.h>
+
+// HID report details
+#define	REPORTID_MOUSE	1
+#define	REPORTID_KEYBD	2
+#define	REPORTID_CONSUMER	3
+#define	REPORTID_GAMEPAD	4
+#define	BOOT_REPORTID_KEYBD	1	// boot protocol report IDs are fixed by the HID profile
+#define	BOOT_REPORTID_MOUSE	2
+
+// HIDP transaction headers: message type in the high nibble, parameter in the low
+#define	HIDP_HANDSHAKE		0x00
+#define	HIDP_HID_CONTROL	0x10
+#define	HIDP_GET_REPORT		0x40
+#define	HIDP_SET_REPORT		0x50
+#define	HIDP_GET_PROTOCOL	0x60
+#define	HIDP_SET_PROTOCOL	0x70
+#define	HIDP_GET_IDLE		0x80
+#define	HIDP_SET_IDLE		0x90
+#define	HIDP_DATA		0xA0
+#define	HIDP_REPORT_INPUT	0x01	// report type parameters
+#define	HIDP_REPORT_OUTPUT	0x02
+#define	HIDP_REPORT_FEATURE	0x03
+#define	HIDP_GET_REPORT_SIZE	0x08	// a buffer size follows the report ID
+#define	HIDP_PROTOCOL_BOOT	0x00
+#define	HIDP_PROTOCOL_REPORT	0x01
+#define	HIDP_HSHK_SUCCESS	0x00	// handshake result codes
+#define	HIDP_HSHK_INVALID_REPORT_ID	0x02
+#define	HIDP_HSHK_UNSUPPORTED	0x03
+#define	HIDP_HSHK_INVALID_PARAMETER	0x04
+#define	HIDP_CTRL_VIRTUAL_CABLE_UNPLUG	0x05
+#define	WHEEL_UNIT	120	// REL_WHEEL_HI_RES units per wheel detent
+#define	GAMEPAD_HAT_NULL	8	// hat value for a centred d-pad
+#define	POINTER_FRAC_BITS	16	// pointer motion is kept in Q16.16 counts
+#define	POINTER_ONE	(1 << POINTER_FRAC_BITS)
+#define	POINTER_LUT_SIZE	128	// frame speeds with their own gain entry
+#define	POINTER_GAIN_MAX	32	// acceleration stops growing here
+#define	POINTER_THRESHOLD_DEFAULT	4	// counts per frame before acceleration starts
+#define	KEYB_SLOTS	6	// key array length of the 6KRO report
+#define	NKRO_BYTES	((0xE7 + 1) / 8)	// bitmap bytes of the NKRO report
+#define	HID_ERR_ROLLOVER	0x01	// fills every slot when too many keys are down
+#define	TRACE_RING_SIZE	65536	// latency trace records kept, power of two
+#define	CAPTURE_MAGIC	"BTHIDCAP"
+#define	CAPTURE_VERSION	1
+#define	RING_SIZE	4096	// capture -> sender events in flight, power of two
+#define	RING_DEVICE_SETUP	0xFFFF	// ring record type: apply a device slot's staged tables
+#define	EVENT_BATCH	64	// input_events fetched per read() on a device
+#define	KEY_RESYNC	0x100	// flag on the value of a key edge made up by a resync
+#define	EPOLL_BATCH	16	// epoll_events fetched per epoll_wait()
+#define	BENCH_FRAMES	200000	// input frames in each --bench stream
+#define	BENCH_LOOKUPS	10000000	// keycode lookups timed by --bench, per method
+#define	BENCH_POINTER_FRAMES	2000000	// pointer frames timed by --bench, per speed and method
+#define	HOSTS_MAX	4	// hosts connected at the same time
+#define	REMAP_LAYERS_MAX	8	// --keymap layers, including the base layer
+#define	TAPHOLD_MS_DEFAULT	200	// tap-hold keys held longer than this are a hold
+#define	TAPHOLD_MS_MAX	10000
+#define	MACRO_STEP_MS	8	// time between the frames a macro is typed in
+#define	MACRO_QUEUE	8	// macros waiting behind the one being typed
+#define	RECONNECT_WINDOW_DEFAULT	30	// seconds to keep devices grabbed for the last host
+#define	RECONNECT_BACKOFF_MIN_MS	250
+#define	RECONNECT_BACKOFF_MAX_MS	4000
+#define	RECONNECT_PAGE_TIMEOUT		3	// seconds per L2CAP connect attempt
+#define	PAIR_TIMEOUT_MS	5000	// a control channel waits this long for its interrupt channel
+#define	REPORT_RATE_DEFAULT	1000	// Hz, mouse reports while motion is pending
+
+// HID report descriptors, described item by item and encoded at compile
+// time. Each item gets the smallest data size that holds its value, as the
+// HID spec recommends, and the checks next to the report structs below read
+// the same lists to prove each struct matches the layout the host parses.
+#define	HID_INPUT		0x80	// main items
+#define	HID_OUTPUT		0x90
+#define	HID_FEATURE		0xB0
+#define	HID_COLLECTION		0xA0
+#define	HID_END_COLLECTION	0xC0
+#define	HID_USAGE_PAGE		0x04	// global items
+#define	HID_LOGICAL_MIN		0x14
+#define	HID_LOGICAL_MAX		0x24
+#define	HID_PHYSICAL_MIN	0x34
+#define	HID_PHYSICAL_MAX	0x44
+#define	HID_UNIT		0x64
+#define	HID_REPORT_SIZE		0x74
+#define	HID_REPORT_ID		0x84
+#define	HID_REPORT_COUNT	0x94
+#define	HID_USAGE		0x08	// local items
+#define	HID_USAGE_MIN		0x18
+#define	HID_USAGE_MAX		0x28
+#define	HID_PHYSICAL		0x00	// collection types
+#define	HID_APPLICATION		0x01
+#define	HID_LOGICAL		0x02
+#define	HID_CONST		0x01	// main item flags
+#define	HID_VAR			0x02
+#define	HID_REL			0x04
+#define	HID_NULL_STATE		0x40
+#define	HID_PAGE_DESKTOP	0x01
+#define	HID_PAGE_SIMULATION	0x02
+#define	HID_PAGE_KEYBOARD	0x07
+#define	HID_PAGE_LED		0x08
+#define	HID_PAGE_BUTTON		0x09
+#define	HID_PAGE_CONSUMER	0x0C
+#define	HID_USAGE_X		0x30	// generic desktop
+#define	HID_USAGE_Y		0x31
+#define	HID_USAGE_Z		0x32
+#define	HID_USAGE_RZ		0x35
+#define	HID_USAGE_WHEEL		0x38
+#define	HID_USAGE_HAT		0x39
+#define	HID_USAGE_RES_MULTIPLIER	0x48
+#define	HID_USAGE_AC_PAN	0x238	// consumer
+
+struct hid_item_t {
+	unsigned char	prefix;		// tag and type; the size bits are added on encoding
+	int32_t		value;
+};
+
+struct hid_range_t {
+	int32_t		min, max;
+};
+
+constexpr size_t hid_item_size(const hid_item_t& it) {
+    if (it.prefix == HID_END_COLLECTION) return 0;
+    if (it.prefix == HID_LOGICAL_MIN || it.prefix == HID_LOGICAL_MAX ||
+        it.prefix == HID_PHYSICAL_MIN || it.prefix == HID_PHYSICAL_MAX) {
+        return it.value >= -128 && it.value <= 127 ? 1 : it.value >= -32768 && it.value <= 32767 ? 2 : 4;
+    }
+    return (uint32_t)it.value <= 0xFF ? 1 : (uint32_t)it.value <= 0xFFFF ? 2 : 4;
+}
+
+template <size_t N>
+constexpr size_t hid_encoded_size(const hid_item_t (&items)[N]) {
+    size_t n = 0;
+    for (const hid_item_t& it : items) n += 1 + hid_item_size(it);
+    return n;
+}
+
+template <size_t Bytes, size_t N>
+constexpr std::array<unsigned char, Bytes> hid_encode(const hid_item_t (&items)[N]) {
+    std::array<unsigned char, Bytes> out = {};
+    size_t n = 0;
+    for (const hid_item_t& it : items) {
+        size_t size = hid_item_size(it);
+        out[n++] = it.prefix | (size == 4 ? 3 : size);
+        for (size_t i = 0; i < size; ++i) out[n++] = (unsigned char)((uint32_t)it.value >> (8 * i));
+    }
+    return out;
+}
+#define	HID_ENCODE(items)	hid_encode<hid_encoded_size(items)>(items)
+
+// Bits in the reports of one kind (HID_INPUT, HID_OUTPUT or HID_FEATURE) with the given ID
+template <size_t N>
+constexpr int32_t hid_report_bits(const hid_item_t (&items)[N], unsigned char kind, int32_t report_id) {
+    int32_t size = 0, count = 0, id = 0, bits = 0;
+    for (const hid_item_t& it : items) {
+        if (it.prefix == HID_REPORT_SIZE) size = it.value;
+        else if (it.prefix == HID_REPORT_COUNT) count = it.value;
+        else if (it.prefix == HID_REPORT_ID) id = it.value;
+        else if (it.prefix == kind && id == report_id) bits += size * count;
+    }
+    return bits;
+}
+
+// Logical range of the input field carrying a usage, {0, 0} if there is none
+template <size_t N>
+constexpr hid_range_t hid_field_range(const hid_item_t (&items)[N], int32_t page, int32_t usage) {
+    int32_t cur_page = 0, usage_min = -1;
+    hid_range_t range = { 0, 0 };
+    bool hit = false;
+    for (const hid_item_t& it : items) {
+        switch (it.prefix) {
+            case HID_USAGE_PAGE: cur_page = it.value; break;
+            case HID_LOGICAL_MIN: range.min = it.value; break;
+            case HID_LOGICAL_MAX: range.max = it.value; break;
+            case HID_USAGE: hit = hit || (cur_page == page && it.value == usage); break;
+            case HID_USAGE_MIN: usage_min = it.value; break;
+            case HID_USAGE_MAX: hit = hit || (cur_page == page && usage >= usage_min && usage <= it.value); break;
+            case HID_INPUT:
+                if (hit) return range;
+                [[fallthrough]];
+            case HID_OUTPUT:
+            case HID_FEATURE:
+            case HID_COLLECTION:
+            case HID_END_COLLECTION:
+                hit = false; // Local items end with each main item
+                break;
+        }
+    }
+    return { 0, 0 };
+}
+
+constexpr hid_item_t HID_MOUSE[] = {
+    { HID_USAGE_PAGE, HID_PAGE_DESKTOP }, { HID_USAGE, 0x02 }, { HID_COLLECTION, HID_APPLICATION },	// mouse
+    { HID_REPORT_ID, REPORTID_MOUSE }, { HID_USAGE, 0x01 }, { HID_COLLECTION, HID_PHYSICAL },		// pointer
+    { HID_USAGE_PAGE, HID_PAGE_BUTTON }, { HID_USAGE_MIN, 1 }, { HID_USAGE_MAX, 3 },			// 3 buttons
+    { HID_LOGICAL_MIN, 0 }, { HID_LOGICAL_MAX, 1 }, { HID_REPORT_SIZE, 1 }, { HID_REPORT_COUNT, 3 }, { HID_INPUT, HID_VAR },
+    { HID_REPORT_SIZE, 5 }, { HID_REPORT_COUNT, 1 }, { HID_INPUT, HID_CONST | HID_VAR },
+    { HID_USAGE_PAGE, HID_PAGE_DESKTOP }, { HID_USAGE, HID_USAGE_X }, { HID_USAGE, HID_USAGE_Y }, { HID_USAGE, HID_USAGE_WHEEL },
+    { HID_LOGICAL_MIN, -127 }, { HID_LOGICAL_MAX, 127 }, { HID_REPORT_SIZE, 8 }, { HID_REPORT_COUNT, 3 },
+    { HID_INPUT, HID_VAR | HID_REL },
+    { HID_END_COLLECTION, 0 }, { HID_END_COLLECTION, 0 },
+};
+
+// High resolution mouse: 16-bit X/Y, plus vertical and horizontal wheels
+// that each sit in a logical collection with a Resolution Multiplier feature
+// (1 or 120), so hosts that support it get 1/120 detent wheel steps.
+#define	HID_RES_MULTIPLIER_ITEMS \
+    { HID_USAGE, HID_USAGE_RES_MULTIPLIER }, { HID_LOGICAL_MIN, 0 }, { HID_LOGICAL_MAX, 1 }, \
+    { HID_PHYSICAL_MIN, 1 }, { HID_PHYSICAL_MAX, WHEEL_UNIT }, { HID_REPORT_SIZE, 2 }, { HID_REPORT_COUNT, 1 }, \
+    { HID_FEATURE, HID_VAR }, { HID_PHYSICAL_MIN, 0 }, { HID_PHYSICAL_MAX, 0 }
+constexpr hid_item_t HID_MOUSE_HIRES[] = {
+    { HID_USAGE_PAGE, HID_PAGE_DESKTOP }, { HID_USAGE, 0x02 }, { HID_COLLECTION, HID_APPLICATION },
+    { HID_REPORT_ID, REPORTID_MOUSE }, { HID_USAGE, 0x01 }, { HID_COLLECTION, HID_PHYSICAL },
+    { HID_USAGE_PAGE, HID_PAGE_BUTTON }, { HID_USAGE_MIN, 1 }, { HID_USAGE_MAX, 3 },
+    { HID_LOGICAL_MIN, 0 }, { HID_LOGICAL_MAX, 1 }, { HID_REPORT_SIZE, 1 }, { HID_REPORT_COUNT, 3 }, { HID_INPUT, HID_VAR },
+    { HID_REPORT_SIZE, 5 }, { HID_REPORT_COUNT, 1 }, { HID_INPUT, HID_CONST | HID_VAR },
+    { HID_USAGE_PAGE, HID_PAGE_DESKTOP }, { HID_USAGE, HID_USAGE_X }, { HID_USAGE, HID_USAGE_Y },
+    { HID_LOGICAL_MIN, -32767 }, { HID_LOGICAL_MAX, 32767 }, { HID_REPORT_SIZE, 16 }, { HID_REPORT_COUNT, 2 },
+    { HID_INPUT, HID_VAR | HID_REL },
+    { HID_COLLECTION, HID_LOGICAL }, HID_RES_MULTIPLIER_ITEMS,						// wheel
+    { HID_USAGE, HID_USAGE_WHEEL }, { HID_LOGICAL_MIN, -32767 }, { HID_LOGICAL_MAX, 32767 },
+    { HID_REPORT_SIZE, 16 }, { HID_REPORT_COUNT, 1 }, { HID_INPUT, HID_VAR | HID_REL }, { HID_END_COLLECTION, 0 },
+    { HID_COLLECTION, HID_LOGICAL }, HID_RES_MULTIPLIER_ITEMS,						// horizontal wheel
+    { HID_USAGE_PAGE, HID_PAGE_CONSUMER }, { HID_USAGE, HID_USAGE_AC_PAN }, { HID_LOGICAL_MIN, -32767 }, { HID_LOGICAL_MAX, 32767 },
+    { HID_REPORT_SIZE, 16 }, { HID_REPORT_COUNT, 1 }, { HID_INPUT, HID_VAR | HID_REL }, { HID_END_COLLECTION, 0 },
+    { HID_REPORT_SIZE, 4 }, { HID_REPORT_COUNT, 1 }, { HID_FEATURE, HID_CONST | HID_VAR },		// feature padding
+    { HID_END_COLLECTION, 0 }, { HID_END_COLLECTION, 0 },
+};
+
+// Keyboard LED output report: Num, Caps, Scroll Lock, Compose, Kana, padding
+#define	HID_KEYBD_LED_ITEMS \
+    { HID_USAGE_PAGE, HID_PAGE_LED }, { HID_USAGE_MIN, 1 }, { HID_USAGE_MAX, 5 }, { HID_LOGICAL_MIN, 0 }, \
+    { HID_LOGICAL_MAX, 1 }, { HID_REPORT_SIZE, 1 }, { HID_REPORT_COUNT, 5 }, { HID_OUTPUT, HID_VAR }, \
+    { HID_REPORT_COUNT, 1 }, { HID_REPORT_SIZE, 3 }, { HID_OUTPUT, HID_CONST }
+
+// Boot compatible 6KRO keyboard: modifiers, reserved byte, six key slots
+constexpr hid_item_t HID_KEYBD[] = {
+    { HID_USAGE_PAGE, HID_PAGE_DESKTOP }, { HID_USAGE, 0x06 }, { HID_COLLECTION, HID_APPLICATION },	// keyboard
+    { HID_REPORT_ID, REPORTID_KEYBD }, { HID_COLLECTION, HID_PHYSICAL },
+    { HID_USAGE_PAGE, HID_PAGE_KEYBOARD }, { HID_USAGE_MIN, 0xE0 }, { HID_USAGE_MAX, 0xE7 },		// modifiers
+    { HID_LOGICAL_MIN, 0 }, { HID_LOGICAL_MAX, 1 }, { HID_REPORT_SIZE, 1 }, { HID_REPORT_COUNT, 8 }, { HID_INPUT, HID_VAR },
+    { HID_REPORT_COUNT, 1 }, { HID_REPORT_SIZE, 8 }, { HID_INPUT, HID_CONST },				// reserved
+    { HID_REPORT_COUNT, KEYB_SLOTS }, { HID_REPORT_SIZE, 8 }, { HID_LOGICAL_MIN, 0 }, { HID_LOGICAL_MAX, 0xE7 },
+    { HID_USAGE_PAGE, HID_PAGE_KEYBOARD }, { HID_USAGE_MIN, 0 }, { HID_USAGE_MAX, 0xE7 }, { HID_INPUT, 0 },
+    HID_KEYBD_LED_ITEMS,
+    { HID_END_COLLECTION, 0 }, { HID_END_COLLECTION, 0 },
+};
+
+// N-key rollover keyboard: one bit per usage 0x00-0xE7, modifiers included
+constexpr hid_item_t HID_KEYBD_NKRO[] = {
+    { HID_USAGE_PAGE, HID_PAGE_DESKTOP }, { HID_USAGE, 0x06 }, { HID_COLLECTION, HID_APPLICATION },
+    { HID_REPORT_ID, REPORTID_KEYBD }, { HID_COLLECTION, HID_PHYSICAL },
+    { HID_USAGE_PAGE, HID_PAGE_KEYBOARD }, { HID_USAGE_MIN, 0 }, { HID_USAGE_MAX, 0xE7 },
+    { HID_LOGICAL_MIN, 0 }, { HID_LOGICAL_MAX, 1 }, { HID_REPORT_SIZE, 1 }, { HID_REPORT_COUNT, NKRO_BYTES * 8 },
+    { HID_INPUT, HID_VAR },
+    HID_KEYBD_LED_ITEMS,
+    { HID_END_COLLECTION, 0 }, { HID_END_COLLECTION, 0 },
+};
+
+constexpr hid_item_t HID_CONSUMER[] = {
+    { HID_USAGE_PAGE, HID_PAGE_CONSUMER }, { HID_USAGE, 0x01 }, { HID_COLLECTION, HID_APPLICATION },	// consumer control
+    { HID_REPORT_ID, REPORTID_CONSUMER }, { HID_LOGICAL_MIN, 0 }, { HID_LOGICAL_MAX, 0x3FF },
+    { HID_USAGE_MIN, 0 }, { HID_USAGE_MAX, 0x3FF }, { HID_REPORT_SIZE, 16 }, { HID_REPORT_COUNT, 1 }, { HID_INPUT, 0 },
+    { HID_END_COLLECTION, 0 },
+};
+
+// Gamepad: 16 buttons, hat switch, two sticks as X/Y and Z/Rz, and the
+// triggers as brake and accelerator
+constexpr hid_item_t HID_GAMEPAD[] = {
+    { HID_USAGE_PAGE, HID_PAGE_DESKTOP }, { HID_USAGE, 0x05 }, { HID_COLLECTION, HID_APPLICATION },	// gamepad
+    { HID_REPORT_ID, REPORTID_GAMEPAD },
+    { HID_USAGE_PAGE, HID_PAGE_BUTTON }, { HID_USAGE_MIN, 1 }, { HID_USAGE_MAX, 16 },
+    { HID_LOGICAL_MIN, 0 }, { HID_LOGICAL_MAX, 1 }, { HID_REPORT_SIZE, 1 }, { HID_REPORT_COUNT, 16 }, { HID_INPUT, HID_VAR },
+    { HID_USAGE_PAGE, HID_PAGE_DESKTOP }, { HID_USAGE, HID_USAGE_HAT }, { HID_LOGICAL_MIN, 0 }, { HID_LOGICAL_MAX, 7 },
+    { HID_PHYSICAL_MIN, 0 }, { HID_PHYSICAL_MAX, 315 }, { HID_UNIT, 0x14 },				// degrees
+    { HID_REPORT_SIZE, 4 }, { HID_REPORT_COUNT, 1 }, { HID_INPUT, HID_VAR | HID_NULL_STATE },
+    { HID_UNIT, 0 }, { HID_PHYSICAL_MAX, 0 }, { HID_REPORT_SIZE, 4 }, { HID_REPORT_COUNT, 1 }, { HID_INPUT, HID_CONST | HID_VAR },
+    { HID_USAGE, HID_USAGE_X }, { HID_USAGE, HID_USAGE_Y }, { HID_USAGE, HID_USAGE_Z }, { HID_USAGE, HID_USAGE_RZ },
+    { HID_LOGICAL_MIN, -127 }, { HID_LOGICAL_MAX, 127 }, { HID_REPORT_SIZE, 8 }, { HID_REPORT_COUNT, 4 }, { HID_INPUT, HID_VAR },
+    { HID_USAGE_PAGE, HID_PAGE_SIMULATION }, { HID_USAGE, 0xC5 }, { HID_USAGE, 0xC4 },		// brake, accelerator
+    { HID_LOGICAL_MIN, 0 }, { HID_LOGICAL_MAX, 255 }, { HID_REPORT_SIZE, 8 }, { HID_REPORT_COUNT, 2 }, { HID_INPUT, HID_VAR },
+    { HID_END_COLLECTION, 0 },
+};
+
+constexpr auto HID_MOUSE_BYTES = HID_ENCODE(HID_MOUSE);
+constexpr auto HID_MOUSE_HIRES_BYTES = HID_ENCODE(HID_MOUSE_HIRES);
+constexpr auto HID_KEYBD_BYTES = HID_ENCODE(HID_KEYBD);
+constexpr auto HID_KEYBD_NKRO_BYTES = HID_ENCODE(HID_KEYBD_NKRO);
+constexpr auto HID_CONSUMER_BYTES = HID_ENCODE(HID_CONSUMER);
+constexpr auto HID_GAMEPAD_BYTES = HID_ENCODE(HID_GAMEPAD);
+
+// Everything registered with epoll_fd carries one of these in data.ptr, so a
+// wakeup dispatches straight to its owner without searching any fd list.
+struct fd_handler_t {
+	int	fd;
+	void	(*on_event)(fd_handler_t *handler, uint32_t events);
+	void	*ctx;
+};
+
+// A grabbed evdev node
+struct event_device_t {
+	int		fd;
+	std::string	path;
+	int		index;		// slot in the per-device tables, tags the device in captures
+	bool		syn_dropped;	// kernel overflowed, discard until the next SYN_REPORT
+	fd_handler_t	handler;
+	struct uring_read_t	*uring_read;	// --io-uring: the read posted for it
+	unsigned long	keys_seen[KEY_CNT / (8 * sizeof(unsigned long))];	// key state its events last gave
+};
+
+// Live counters for --metrics. Every counter has a single writing thread,
+// so a bump is a relaxed load and store without a locked instruction, and
+// the metrics handler can read them from the main thread at any time.
+struct device_metrics_t {
+	std::atomic<uint32_t>	generation;	// bumped around a takeover, odd while it runs
+	std::atomic<uint64_t>	events;
+	std::atomic<bool>	grabbed;
+	char			path[64];
+};
+struct metrics_t {
+	std::atomic<uint64_t>	main_wakeups;	// epoll_wait or io_uring_enter returns
+	std::atomic<uint64_t>	capture_wakeups;
+	std::atomic<uint64_t>	reports_sent[8];	// by REPORTID_*
+	std::atomic<uint64_t>	send_errors;	// sends that ended a link
+	std::atomic<uint64_t>	suppressed;	// frames whose encoded report matched the last one sent
+	std::atomic<uint64_t>	queued;		// reports that had to wait for a congested link
+	std::atomic<uint64_t>	merged;		// queued reports folded into the one before them
+	std::atomic<uint64_t>	stalls;		// times the link stopped taking reports
+	std::atomic<uint64_t>	stall_ns;	// total time spent congested
+	device_metrics_t	devices[256];	// by event_device_t::index, as in captures
+};
+
+inline void count(std::atomic<uint64_t>& counter, uint64_t n = 1) {
+    counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+// A device takes over its slot as a seqlock writer: the generation is odd
+// while the path and counters are rewritten, so the metrics handler can
+// tell a torn copy from a whole one
+inline void publish_device_metrics(device_metrics_t& d, const std::string& path) {
+    uint32_t gen = d.generation.load(std::memory_order_relaxed);
+    d.generation.store(gen + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    snprintf(d.path, sizeof(d.path), "%s", path.c_str());
+    d.events.store(0, std::memory_order_relaxed);
+    d.grabbed.store(true, std::memory_order_relaxed);
+    d.generation.store(gen + 2, std::memory_order_release);
+}
+
+// Copies a slot for the metrics handler; false if it never had a device or
+// is being taken over right now
+inline bool read_device_metrics(const device_metrics_t& d, char (&path)[64], bool *grabbed, uint64_t *events) {
+    uint32_t gen = d.generation.load(std::memory_order_acquire);
+    if (gen == 0 || (gen & 1)) return false;
+    memcpy(path, d.path, sizeof(path));
+    path[sizeof(path) - 1] = '\0';
+    *grabbed = d.grabbed.load(std::memory_order_relaxed);
+    *events = d.events.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return d.generation.load(std::memory_order_relaxed) == gen;
+}
+
+// HID report structures
+struct hidrep_mouse_t {
+	unsigned char	btcode;
+	unsigned char	rep_id;
+	unsigned char	button;
+	signed   char	axis_x;
+	signed   char	axis_y;
+	signed   char	axis_z;
+} __attribute__((packed));
+
+struct hidrep_mouse_hires_t {
+	unsigned char	btcode;
+	unsigned char	rep_id;
+	unsigned char	button;
+	short		axis_x;		// little endian
+	short		axis_y;
+	short		wheel;		// detents, or 1/120 detents with the multiplier set
+	short		hwheel;
+} __attribute__((packed));
+
+struct hidrep_keyb_t {
+	unsigned char	btcode;
+	unsigned char	rep_id;
+	unsigned char	modify;
+	unsigned char	reserved;
+	unsigned char	key[KEYB_SLOTS];
+} __attribute__((packed));
+
+struct hidrep_keyb_nkro_t {
+	unsigned char	btcode;
+	unsigned char	rep_id;
+	unsigned char	bits[NKRO_BYTES];	// bit n of byte u/8 is usage u
+} __attribute__((packed));
+
+union keyb_report_u {
+	hidrep_keyb_t		boot;
+	hidrep_keyb_nkro_t	nkro;
+};
+
+struct hidrep_consumer_t {
+	unsigned char	btcode;
+	unsigned char	rep_id;
+	unsigned short	usage;		// little endian, one media key at a time
+} __attribute__((packed));
+
+struct hidrep_gamepad_t {
+	unsigned char	btcode;
+	unsigned char	rep_id;
+	unsigned short	buttons;	// little endian, bit n is BTN_SOUTH + n
+	unsigned char	hat;		// 0-7 clockwise from up, GAMEPAD_HAT_NULL centred
+	signed   char	x, y;		// left stick
+	signed   char	z, rz;		// right stick
+	unsigned char	brake;		// left trigger
+	unsigned char	accel;		// right trigger
+} __attribute__((packed));
+
+// Each struct must carry exactly the fields its descriptor declares: the
+// HIDP header byte and the report ID, then the report itself
+#define	HID_REPORT_BYTES(items, id)	(2 + hid_report_bits(items, HID_INPUT, id) / 8)
+static_assert(HID_REPORT_BYTES(HID_MOUSE, REPORTID_MOUSE) == sizeof(hidrep_mouse_t), "mouse report layout");
+static_assert(HID_REPORT_BYTES(HID_MOUSE_HIRES, REPORTID_MOUSE) == sizeof(hidrep_mouse_hires_t), "hires mouse report layout");
+static_assert(HID_REPORT_BYTES(HID_KEYBD, REPORTID_KEYBD) == sizeof(hidrep_keyb_t), "keyboard report layout");
+static_assert(HID_REPORT_BYTES(HID_KEYBD_NKRO, REPORTID_KEYBD) == sizeof(hidrep_keyb_nkro_t), "NKRO keyboard report layout");
+static_assert(HID_REPORT_BYTES(HID_CONSUMER, REPORTID_CONSUMER) == sizeof(hidrep_consumer_t), "consumer report layout");
+static_assert(HID_REPORT_BYTES(HID_GAMEPAD, REPORTID_GAMEPAD) == sizeof(hidrep_gamepad_t), "gamepad report layout");
+static_assert(hid_report_bits(HID_KEYBD, HID_OUTPUT, REPORTID_KEYBD) == 8 &&
+              hid_report_bits(HID_KEYBD_NKRO, HID_OUTPUT, REPORTID_KEYBD) == 8, "LED output reports are one byte");
+static_assert(hid_report_bits(HID_MOUSE_HIRES, HID_FEATURE, REPORTID_MOUSE) == 8, "both wheel multipliers share one byte");
+static_assert(hid_field_range(HID_GAMEPAD, HID_PAGE_DESKTOP, HID_USAGE_X).min >= -128 &&
+              hid_field_range(HID_GAMEPAD, HID_PAGE_DESKTOP, HID_USAGE_X).max <= 127, "stick fields are int8");
+
+// Mouse report packers, one per layout and picked at compile time. The axis
+// limits are the logical ranges the descriptor declares, and the clamps
+// compile to conditional moves, so packing a report takes no branches.
+inline int hid_clamp(int64_t v, hid_range_t r) {
+    return (int)std::min<int64_t>(r.max, std::max<int64_t>(r.min, v));
+}
+
+template <typename R> struct mouse_layout;
+
+template <> struct mouse_layout<hidrep_mouse_t> {
+    static constexpr hid_range_t xy = hid_field_range(HID_MOUSE, HID_PAGE_DESKTOP, HID_USAGE_X);
+    static constexpr hid_range_t wheel = hid_field_range(HID_MOUSE, HID_PAGE_DESKTOP, HID_USAGE_WHEEL);
+    static constexpr hid_range_t hwheel = hid_field_range(HID_MOUSE, HID_PAGE_CONSUMER, HID_USAGE_AC_PAN); // none
+    static_assert(xy.min >= -128 && xy.max <= 127 && wheel.min >= -128 && wheel.max <= 127, "8-bit mouse fields");
+
+    static void pack(hidrep_mouse_t *m, unsigned char id, unsigned char buttons, int x, int y, int v, int) {
+        m->btcode = 0xA1;
+        m->rep_id = id;
+        m->button = buttons;
+        m->axis_x = x;
+        m->axis_y = y;
+        m->axis_z = v;
+    }
+};
+
+template <> struct mouse_layout<hidrep_mouse_hires_t> {
+    static constexpr hid_range_t xy = hid_field_range(HID_MOUSE_HIRES, HID_PAGE_DESKTOP, HID_USAGE_X);
+    static constexpr hid_range_t wheel = hid_field_range(HID_MOUSE_HIRES, HID_PAGE_DESKTOP, HID_USAGE_WHEEL);
+    static constexpr hid_range_t hwheel = hid_field_range(HID_MOUSE_HIRES, HID_PAGE_CONSUMER, HID_USAGE_AC_PAN);
+    static_assert(xy.min >= -32768 && xy.max <= 32767 && wheel.min >= -32768 && wheel.max <= 32767 &&
+                  hwheel.min >= -32768 && hwheel.max <= 32767, "16-bit mouse fields");
+
+    static void pack(hidrep_mouse_hires_t *m, unsigned char id, unsigned char buttons, int x, int y, int v, int h) {
+        m->btcode = 0xA1;
+        m->rep_id = id;
+        m->button = buttons;
+        m->axis_x = htole16(x);
+        m->axis_y = htole16(y);
+        m->wheel = htole16(v);
+        m->hwheel = htole16(h);
+    }
+};
+
+// Pointer curves (--pointer). Every grabbed device gets one: a gain for each
+// frame speed, computed once at startup in Q16.16, so a frame costs one
+// table lookup and two integer multiplies whatever the curve looks like.
+struct pointer_curve_t {
+	std::string	match;		// substring of the device name or path, empty for the default
+	double		sensitivity;
+	double		accel;		// gain added per count of speed above the threshold
+	int		threshold;	// counts per frame
+	int32_t		gain[POINTER_LUT_SIZE];	// Q16.16, indexed by frame speed
+};
+
+// Gamepad state (--gamepad). Axes are scaled to the report range through a
+// calibration per device, taken from EVIOCGABS when it is grabbed, and
+// only a change of the scaled value marks the report dirty, so a stick
+// jittering in its dead zone or between two steps sends nothing.
+enum pad_axis_t { PAD_X, PAD_Y, PAD_Z, PAD_RZ, PAD_BRAKE, PAD_ACCEL, PAD_AXES };
+
+struct pad_axis_calib_t {
+	int32_t		center;		// raw value reported as 0
+	int32_t		flat;		// dead zone around it
+	int32_t		span;		// raw distance from the dead zone edge to full deflection
+	int32_t		out_max;	// 127 for sticks, 255 for triggers
+};
+struct pad_calib_t {
+	int8_t			slot[ABS_CNT];	// pad_axis_t of each ABS_ code, -1 if unused
+	pad_axis_calib_t	axis[PAD_AXES];
+};
+
+inline uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Latency tracing (--trace). Every input event and every report that carried
+// input leaves a record in a preallocated ring; the per-stage percentiles are
+// computed from the ring on SIGUSR1 and at exit. Device clocks are switched
+// to CLOCK_MONOTONIC so input_event.time is comparable with monotonic_ns().
+enum trace_point_t {
+	TP_KERNEL,	// input_event.time
+	TP_READ,	// read() returned it
+	TP_PROCESSED,	// its frame's SYN_REPORT was handled
+	TP_SEND_START,
+	TP_SEND_END,
+	TP_COUNT
+};
+
+struct trace_record_t {
+	bool		is_report;	// false: an input event, only KERNEL/READ are set
+	uint64_t	t[TP_COUNT];
+};
+
+extern bool trace_enabled;
+extern volatile sig_atomic_t trace_dump_requested;
+extern std::vector<trace_record_t> trace_ring;
+extern uint64_t trace_head;
+extern uint64_t trace_read_ns;
+extern trace_record_t trace_pending;
+
+inline void trace_push(const trace_record_t& rec) {
+    trace_ring[trace_head++ & (TRACE_RING_SIZE - 1)] = rec;
+}
+
+inline void trace_event(const struct input_event *ev) {
+    trace_record_t rec = {};
+    rec.t[TP_KERNEL] = (uint64_t)ev->input_event_sec * 1000000000ULL + ev->input_event_usec * 1000ULL;
+    rec.t[TP_READ] = trace_read_ns;
+    trace_push(rec);
+    if (!trace_pending.t[TP_KERNEL] && ev->type != EV_SYN) trace_pending = rec;
+}
+
+inline void trace_frame_done() {
+    if (trace_pending.t[TP_KERNEL] && !trace_pending.t[TP_PROCESSED]) {
+        trace_pending.t[TP_PROCESSED] = monotonic_ns();
+    }
+}
+
+// Records a report whose send started at `start`, if it carried traced input
+inline void trace_report_sent(uint64_t start) {
+    if (!trace_pending.t[TP_PROCESSED]) return;
+    trace_pending.is_report = true;
+    trace_pending.t[TP_SEND_START] = start;
+    trace_pending.t[TP_SEND_END] = monotonic_ns();
+    trace_push(trace_pending);
+    trace_pending = {};
+}
+
+// io_uring engine (--io-uring), compiled in with -DWITH_IO_URING
+struct host_session_t;
+extern bool use_io_uring;
+#ifdef WITH_IO_URING
+bool uring_active();
+bool uring_start();
+void uring_stop();
+bool uring_watch_device(event_device_t& dev);
+void uring_unwatch_device(event_device_t& dev);
+bool uring_queue_send(host_session_t *s, const unsigned char *rep, size_t len);
+void uring_forget_session(host_session_t *s);
+void uring_settle();
+bool uring_run_once();
+#else
+inline bool uring_active() { return false; }
+inline bool uring_start() {
+    std::cerr << "Built without io_uring (-DWITH_IO_URING), using epoll." << std::endl;
+    return false;
+}
+inline void uring_stop() {}
+inline bool uring_watch_device(event_device_t&) { return false; }
+inline void uring_unwatch_device(event_device_t&) {}
+inline bool uring_queue_send(host_session_t *, const unsigned char *, size_t) { return false; }
+inline void uring_forget_session(host_session_t *) {}
+inline void uring_settle() {}
+inline bool uring_run_once() { return false; }
+#endif
+
+// Linux keycode -> HID usage. This list is the only place a mapping is
+// written down; the lookup tables below are generated from it at compile time.
+enum usage_page_t : unsigned char { PAGE_KEYBD = 0x07, PAGE_CONSUMER = 0x0C };
+
+struct keymap_entry_t {
+	unsigned short	code;
+	usage_page_t	page;
+	unsigned short	usage;
+	const char	*name;
+};
+
+#define KB(code, usage)	{ code, PAGE_KEYBD, usage, #code }
+#define CC(code, usage)	{ code, PAGE_CONSUMER, usage, #code }
+constexpr keymap_entry_t keymap[] = {
+    KB(KEY_A, 0x04), KB(KEY_B, 0x05), KB(KEY_C, 0x06), KB(KEY_D, 0x07), KB(KEY_E, 0x08),
+    KB(KEY_F, 0x09), KB(KEY_G, 0x0A), KB(KEY_H, 0x0B), KB(KEY_I, 0x0C), KB(KEY_J, 0x0D),
+    KB(KEY_K, 0x0E), KB(KEY_L, 0x0F), KB(KEY_M, 0x10), KB(KEY_N, 0x11), KB(KEY_O, 0x12),
+    KB(KEY_P, 0x13), KB(KEY_Q, 0x14), KB(KEY_R, 0x15), KB(KEY_S, 0x16), KB(KEY_T, 0x17),
+    KB(KEY_U, 0x18), KB(KEY_V, 0x19), KB(KEY_W, 0x1A), KB(KEY_X, 0x1B), KB(KEY_Y, 0x1C),
+    KB(KEY_Z, 0x1D), KB(KEY_1, 0x1E), KB(KEY_2, 0x1F), KB(KEY_3, 0x20), KB(KEY_4, 0x21),
+    KB(KEY_5, 0x22), KB(KEY_6, 0x23), KB(KEY_7, 0x24), KB(KEY_8, 0x25), KB(KEY_9, 0x26),
+    KB(KEY_0, 0x27), KB(KEY_ENTER, 0x28), KB(KEY_ESC, 0x29), KB(KEY_BACKSPACE, 0x2A),
+    KB(KEY_TAB, 0x2B), KB(KEY_SPACE, 0x2C), KB(KEY_MINUS, 0x2D), KB(KEY_EQUAL, 0x2E),
+    KB(KEY_LEFTBRACE, 0x2F), KB(KEY_RIGHTBRACE, 0x30), KB(KEY_BACKSLASH, 0x31),
+    KB(KEY_SEMICOLON, 0x33), KB(KEY_APOSTROPHE, 0x34), KB(KEY_GRAVE, 0x35),
+    KB(KEY_COMMA, 0x36), KB(KEY_DOT, 0x37), KB(KEY_SLASH, 0x38), KB(KEY_CAPSLOCK, 0x39),
+    KB(KEY_F1, 0x3A), KB(KEY_F2, 0x3B), KB(KEY_F3, 0x3C), KB(KEY_F4, 0x3D), KB(KEY_F5, 0x3E),
+    KB(KEY_F6, 0x3F), KB(KEY_F7, 0x40), KB(KEY_F8, 0x41), KB(KEY_F9, 0x42), KB(KEY_F10, 0x43),
+    KB(KEY_F11, 0x44), KB(KEY_F12, 0x45), KB(KEY_SYSRQ, 0x46), KB(KEY_SCROLLLOCK, 0x47),
+    KB(KEY_PAUSE, 0x48), KB(KEY_INSERT, 0x49), KB(KEY_HOME, 0x4A), KB(KEY_PAGEUP, 0x4B),
+    KB(KEY_DELETE, 0x4C), KB(KEY_END, 0x4D), KB(KEY_PAGEDOWN, 0x4E), KB(KEY_RIGHT, 0x4F),
+    KB(KEY_LEFT, 0x50), KB(KEY_DOWN, 0x51), KB(KEY_UP, 0x52), KB(KEY_NUMLOCK, 0x53),
+    KB(KEY_KPSLASH, 0x54), KB(KEY_KPASTERISK, 0x55), KB(KEY_KPMINUS, 0x56),
+    KB(KEY_KPPLUS, 0x57), KB(KEY_KPENTER, 0x58), KB(KEY_KP1, 0x59), KB(KEY_KP2, 0x5A),
+    KB(KEY_KP3, 0x5B), KB(KEY_KP4, 0x5C), KB(KEY_KP5, 0x5D), KB(KEY_KP6, 0x5E),
+    KB(KEY_KP7, 0x5F), KB(KEY_KP8, 0x60), KB(KEY_KP9, 0x61), KB(KEY_KP0, 0x62),
+    KB(KEY_KPDOT, 0x63), KB(KEY_102ND, 0x64), KB(KEY_COMPOSE, 0x65), KB(KEY_POWER, 0x66),
+    KB(KEY_KPEQUAL, 0x67), KB(KEY_F13, 0x68), KB(KEY_F14, 0x69), KB(KEY_F15, 0x6A),
+    KB(KEY_F16, 0x6B), KB(KEY_F17, 0x6C), KB(KEY_F18, 0x6D), KB(KEY_F19, 0x6E),
+    KB(KEY_F20, 0x6F), KB(KEY_F21, 0x70), KB(KEY_F22, 0x71), KB(KEY_F23, 0x72),
+    KB(KEY_F24, 0x73), KB(KEY_OPEN, 0x74), KB(KEY_HELP, 0x75), KB(KEY_PROPS, 0x76),
+    KB(KEY_FRONT, 0x77), KB(KEY_STOP, 0x78), KB(KEY_AGAIN, 0x79), KB(KEY_UNDO, 0x7A),
+    KB(KEY_CUT, 0x7B), KB(KEY_COPY, 0x7C), KB(KEY_PASTE, 0x7D), KB(KEY_FIND, 0x7E),
+    KB(KEY_KPCOMMA, 0x85), KB(KEY_RO, 0x87), KB(KEY_KATAKANAHIRAGANA, 0x88),
+    KB(KEY_YEN, 0x89), KB(KEY_HENKAN, 0x8A), KB(KEY_MUHENKAN, 0x8B), KB(KEY_KPJPCOMMA, 0x8C),
+    KB(KEY_HANGEUL, 0x90), KB(KEY_HANJA, 0x91), KB(KEY_KATAKANA, 0x92),
+    KB(KEY_HIRAGANA, 0x93), KB(KEY_ZENKAKUHANKAKU, 0x94),
+    KB(KEY_KPLEFTPAREN, 0xB6), KB(KEY_KPRIGHTPAREN, 0xB7),
+    KB(KEY_LEFTCTRL, 0xE0), KB(KEY_LEFTSHIFT, 0xE1), KB(KEY_LEFTALT, 0xE2),
+    KB(KEY_LEFTMETA, 0xE3), KB(KEY_RIGHTCTRL, 0xE4), KB(KEY_RIGHTSHIFT, 0xE5),
+    KB(KEY_RIGHTALT, 0xE6), KB(KEY_RIGHTMETA, 0xE7),
+
+    // Media keys go to the consumer page, which phones and tablets act on
+    CC(KEY_MUTE, 0xE2), CC(KEY_VOLUMEUP, 0xE9), CC(KEY_VOLUMEDOWN, 0xEA),
+    CC(KEY_PLAYPAUSE, 0xCD), CC(KEY_PLAYCD, 0xB0), CC(KEY_PAUSECD, 0xB1),
+    CC(KEY_FASTFORWARD, 0xB3), CC(KEY_REWIND, 0xB4), CC(KEY_NEXTSONG, 0xB5),
+    CC(KEY_PREVIOUSSONG, 0xB6), CC(KEY_STOPCD, 0xB7), CC(KEY_EJECTCD, 0xB8),
+    CC(KEY_BRIGHTNESSUP, 0x6F), CC(KEY_BRIGHTNESSDOWN, 0x70), CC(KEY_MENU, 0x40),
+    CC(KEY_MAIL, 0x18A), CC(KEY_CALC, 0x192), CC(KEY_COMPUTER, 0x194),
+    CC(KEY_WWW, 0x196), CC(KEY_SEARCH, 0x221), CC(KEY_HOMEPAGE, 0x223),
+    CC(KEY_BACK, 0x224), CC(KEY_FORWARD, 0x225), CC(KEY_REFRESH, 0x227),
+    CC(KEY_BOOKMARKS, 0x22A),
+};
+#undef KB
+#undef CC
+
+template <typename T>
+constexpr std::array<T, KEY_CNT> build_usage_table(usage_page_t page) {
+    std::array<T, KEY_CNT> table = {};
+    for (const keymap_entry_t& entry : keymap) {
+        if (entry.page == page) table[entry.code] = static_cast<T>(entry.usage);
+    }
+    return table;
+}
+
+constexpr std::array<unsigned char, KEY_CNT> keyboard_usages = build_usage_table<unsigned char>(PAGE_KEYBD);
+constexpr std::array<unsigned short, KEY_CNT> consumer_usages = build_usage_table<unsigned short>(PAGE_CONSUMER);
+static_assert(keyboard_usages[KEY_A] == 0x04 && keyboard_usages[KEY_RIGHTMETA] == 0xE7,
+              "keyboard usage table generated incorrectly");
+
+// Keyboard page usage for a keycode, 0 if it has none. 0xE0-0xE7 are modifiers.
+inline unsigned char map_key_to_hid(int code) {
+    return (unsigned)code < KEY_CNT ? keyboard_usages[code] : 0;
+}
+
+// Consumer page usage for a keycode, 0 if it has none
+inline unsigned short map_key_to_consumer(int code) {
+    return (unsigned)code < KEY_CNT ? consumer_usages[code] : 0;
+}
+
+// Frame encoder bookkeeping. process_one_event only updates state; reports
+// go out at the end of each input frame and only when they change something.
+// The counters --metrics exports live in metrics_t.
+struct report_stats_t {
+	uint64_t	sent;
+	uint64_t	stall_max_ns;	// longest time spent congested
+	size_t		max_depth;	// most reports waiting at once
+	uint64_t	send_calls;	// send() calls, or io_uring_enter() calls that sent reports
+};
+
+inline bool keybit(const unsigned char *bits, unsigned char usage) {
+    return bits[usage >> 3] & (1 << (usage & 7));
+}
+
+inline unsigned char keyb_report_id(bool boot) {
+    return boot ? BOOT_REPORTID_KEYBD : REPORTID_KEYBD;
+}
+
+inline unsigned char mouse_report_id(bool boot) {
+    return boot ? BOOT_REPORTID_MOUSE : REPORTID_MOUSE;
+}
+
+// Which of our reports (REPORTID_*) an encoded input report is
+inline unsigned char report_kind(const unsigned char *rep, bool boot) {
+    if (!boot) return rep[1];
+    return rep[1] == BOOT_REPORTID_KEYBD ? REPORTID_KEYBD : REPORTID_MOUSE;
+}
+
+// Interrupt channel send queue. Each interrupt channel is non-blocking with
+// a minimal send buffer, so a congested link shows up as EAGAIN instead of
+// stalling the whole loop while stale reports pile up in the kernel. Reports that
+// cannot go out wait here and leave on EPOLLOUT; while they wait, a new
+// report is folded into the newest queued one whenever the host cannot
+// tell the difference, so the queue holds changes rather than history.
+// Pointer motion is not queued at all: it waits in the accumulators and
+// leaves as one report once the queue is empty again.
+#define	SEND_QUEUE_MAX	64	// past this, newer state overwrites older
+#define	SEND_BUFFER_BYTES	1024	// the kernel rounds this up to its minimum
+#define	SEND_FLUSH_TIMEOUT_MS	500
+
+struct queued_report_t {
+	unsigned char	data[sizeof(keyb_report_u)];
+	size_t		len;
+	unsigned char	keys_before[32];	// keyboard reports: the state they change
+};
+
+// One connected host. Several can be connected at once; input goes to the
+// one with focus, the others stay connected and answer their control
+// traffic until the switch hotkey moves focus to them. Each one remembers
+// what it was last told, so a frame only sends it changes and losing focus
+// sends it exactly the releases it needs.
+struct host_session_t {
+	int		ctl;		// -1 while the link is down
+	int		intr;
+	std::string	peer;
+	int		number;		// shown to the user, 1 upwards
+	fd_handler_t	ctl_handler;
+	fd_handler_t	int_handler;
+	bool		up;
+	bool		dead;		// erased once the current epoll batch is done
+	// Set by the host over the control channel
+	bool		boot_protocol;	// every connection starts in report protocol
+	int		wheel_multiplier;	// WHEEL_UNIT once the Resolution Multiplier is set
+	unsigned char	idle_rate;	// SET_IDLE, stored only: reports are sent on change
+	unsigned char	leds;
+	bool		unplugged;	// virtual cable unplug, do not reconnect
+	// The last state this host was sent
+	keyb_report_u	last_keyb_report;
+	size_t		last_keyb_len;
+	unsigned char	last_mouse_buttons;
+	unsigned short	last_consumer_usage;
+	hidrep_gamepad_t	last_gamepad_report;
+	// Interrupt channel send queue
+	std::deque<queued_report_t> send_queue;
+	unsigned char	accepted_keys[32];	// keyboard state of the newest report sent or queued
+	uint64_t	stall_start_ns;
+	bool		draining;	// EPOLLOUT watched until send_queue is empty
+	// --io-uring: sends submitted and not completed yet, and how many of
+	// them came back unsent and went to the front of send_queue
+	int		uring_inflight;
+	size_t		uring_requeued;
+	// Reconnection while the link is down
+	uint64_t	lost_ns;
+	uint64_t	next_attempt_ns;	// next page, or the end of the one in progress
+	int		backoff_ms;
+	int		connecting[2];	// control and interrupt channel being paged, -1 when not
+	fd_handler_t	connect_handler;
+};
+
+extern std::list<host_session_t> sessions;
+extern host_session_t *focus;
+
+inline bool focus_up() {
+    return focus && focus->up;
+}
+
+// Reports still waiting in send_queue or submitted to io_uring
+inline bool send_backlogged(const host_session_t *s) {
+    return !s->send_queue.empty() || s->uring_inflight;
+}
+
+// Key remapping (--keymap)
+enum remap_kind_t : uint8_t { REMAP_KEY, REMAP_NONE, REMAP_LAYER, REMAP_TAPHOLD, REMAP_MACRO };
+
+struct remap_action_t {
+	remap_kind_t	kind;
+	uint8_t		layer;		// REMAP_LAYER: layer active while the key is down
+	uint16_t	code;		// key sent, the tap key of REMAP_TAPHOLD, or the macro index
+	uint16_t	hold;		// REMAP_TAPHOLD: key sent when held
+	uint16_t	hold_ms;	// REMAP_TAPHOLD: held longer than this is a hold
+};
+typedef std::array<remap_action_t, KEY_CNT> remap_layer_t;
+
+// Where drained input events go: straight into process_one_event, or into
+// the ring for the sender thread. read_ns is the read() time for --trace,
+// device the event_device_t::index it came from.
+typedef void (*event_sink_t)(struct input_event *ev, uint64_t read_ns, uint8_t device);
+
+// Capture files (--record / --replay). A 16 byte header followed by fixed
+// 16 byte records, so a capture can be mmap()ed and walked as an array.
+struct capture_header_t {
+	char		magic[8];	// CAPTURE_MAGIC
+	uint16_t	version;
+	uint16_t	record_size;	// sizeof(capture_event_t)
+	uint32_t	reserved;
+} __attribute__((packed));
+
+struct capture_event_t {
+	uint64_t	time_ns;	// input_event.time of the original event
+	int32_t		value;
+	uint16_t	code;
+	uint8_t		type;
+	uint8_t		device;		// event_device_t::index
+} __attribute__((packed));
+
+static_assert(sizeof(capture_header_t) == 16 && sizeof(capture_event_t) == 16,
+              "capture layout changed, bump CAPTURE_VERSION");
+
+// Transports. Each backend hands the main loop a connected control and
+// interrupt pair of SOCK_SEQPACKET fds, so everything past accept is shared.
+struct transport_t {
+	const char	*name;
+	bool		needs_sdp;	// register the HID service record first
+	bool		(*open_listeners)(void);	// sets ctl_sock and int_sock, non-blocking
+	int		(*accept_channel)(int listener, std::string *peer);	// -1 once none is waiting
+	int		(*connect_channel)(const std::string& peer, bool interrupt);	// non-blocking, may be null
+};
+
+// bthid-reports.cpp: input state and the event -> report pipeline
+extern char mousebuttons;
+extern unsigned char keybits[32];
+extern bool keyboard_nkro;
+extern unsigned short consumerkey;
+extern int64_t dx, dy;
+extern int dz, dh;
+extern pointer_curve_t default_curve;
+extern std::array<const pointer_curve_t *, 256> device_curves;
+extern bool gamepad;
+extern int pad_deadzone_pct;
+extern pad_calib_t pad_calibs[256];
+extern bool mouse_hires;
+extern int switch_key;
+extern std::string hid_descriptor;
+extern int report_rate_hz;
+extern int report_timer_fd;
+extern fd_handler_t report_timer_handler;
+extern report_stats_t report_stats;
+extern bool keyb_dirty, mouse_dirty, consumer_dirty, gamepad_dirty;
+extern std::vector<remap_layer_t> remap_layers;
+extern int remap_timer_fd;
+extern fd_handler_t remap_timer_handler;
+
+void build_pointer_curve(pointer_curve_t *c);
+bool add_pointer_curve(const char *spec);
+const pointer_curve_t *pointer_curve_for(const char *name, const std::string& path);
+void default_pad_calib(pad_calib_t *c);
+void calibrate_pad(int fd, pad_calib_t *c);
+std::string build_hid_descriptor();
+int key_by_name(const char *name);
+size_t encode_keyb_report(keyb_report_u *rep, const unsigned char *bits, bool boot);
+void decode_keyb_report(const unsigned char *rep, size_t len, unsigned char *bits);
+bool merge_mouse_report(unsigned char *dst, const unsigned char *src, size_t len);
+void queue_report(host_session_t *s, const void *rep, size_t len);
+void link_lost(host_session_t *s, const char *what);
+void backlog_cleared(host_session_t *s);
+void begin_stall(host_session_t *s);
+bool send_report(host_session_t *s, const void *rep, size_t len);
+void drain_send_queue(host_session_t *s);
+void flush_send_queue(host_session_t *s, int timeout_ms);
+size_t encode_mouse_report(unsigned char *buf, unsigned char buttons, bool boot);
+void encode_gamepad_report(hidrep_gamepad_t *rep, bool current);
+void reset_report_history(host_session_t *s);
+void release_host_keys(host_session_t *s);
+void on_remap_timer(fd_handler_t *handler, uint32_t events);
+void clear_input_state();
+bool load_keymap(const char *path);
+void process_one_event(struct input_event *inevent, uint8_t device);
+bool motion_pending();
+void send_pending_reports();
+void arm_report_timer();
+void disarm_report_timer();
+void on_report_timer(fd_handler_t *handler, uint32_t events);
+void print_report_jitter();
+void print_report_stats();
+
+// bthid-input.cpp: event loop registration, input devices, capture and replay
+extern int epoll_fd;
+extern int device_epoll_fd;
+extern std::list<event_device_t> event_devices;
+extern int inotify_fd;
+extern bool grabbing;
+extern int led_event_fd;
+extern FILE *record_file;
+extern const capture_event_t *replay_events;
+extern size_t replay_map_len;
+extern bool replay_fast;
+extern int replay_timer_fd;
+extern fd_handler_t replay_handler;
+extern bool threaded;
+extern int rt_priority;
+extern int capture_cpu, sender_cpu;
+extern bool lock_memory;
+extern int ring_event_fd;
+extern int capture_stop_fd;
+extern fd_handler_t ring_handler, capture_stop_handler;
+extern std::atomic<uint64_t> ring_full_waits;
+
+void trace_signal_handler(int signum);
+void dump_trace();
+bool watch_fd(fd_handler_t *handler, uint32_t events, int epfd = epoll_fd);
+void watch_fd_events(fd_handler_t *handler, uint32_t events, int epfd = epoll_fd);
+void unwatch_fd(int fd, int epfd = epoll_fd);
+void set_host_leds(unsigned char leds);
+bool start_device_manager();
+int drain_event_device(event_device_t& dev, event_sink_t sink);
+void close_event_devices();
+int init_event_devices();
+bool open_capture_for_record(const char *path);
+bool open_capture_for_replay(const char *path);
+void on_replay_timer(fd_handler_t *handler, uint32_t events);
+void start_replay();
+void on_ring_event(fd_handler_t *handler, uint32_t events);
+void on_capture_stop(fd_handler_t *handler, uint32_t events);
+void tune_current_thread(const char *role, int cpu);
+void start_capture_thread();
+void stop_capture_thread();
+
+// bthid-link.cpp: control channel, transports, host sessions and the main loop
+extern volatile bool keep_running;
+extern int ctl_sock, int_sock;
+extern std::string unix_path;
+extern const transport_t transport_unix;
+extern const transport_t *transport;
+extern int reconnect_window;
+extern int reconnect_timer_fd;
+extern fd_handler_t reconnect_timer_handler;
+extern std::string metrics_path;
+extern metrics_t metrics;
+extern uint64_t start_ns;
+
+void signal_handler(int signum);
+void handle_control_message(host_session_t *s, const unsigned char *msg, ssize_t len);
+bool unix_addr(const std::string& path, struct sockaddr_un *addr);
+void set_focus(host_session_t *s);
+void switch_focus();
+host_session_t *add_session(const std::string& peer);
+void activate_session(host_session_t *s, int ctl, int intr);
+void host_connected(int ctl, int intr, const std::string& peer);
+void session_down(host_session_t *s);
+void on_reconnect_timer(fd_handler_t *handler, uint32_t events);
+void reap_sessions();
+void close_sessions();
+std::string format_metrics();
+bool init_pipeline(const char *record_path, const char *replay_path, const char *keymap_path);
+int run_emulator();
+
+// bthid-refhost.cpp and bthid-bench.cpp
+extern bool host_boot;
+bool check_report(const unsigned char *rep, ssize_t len, std::string *text);
+int run_reference_host(const std::string& path);
+int run_benchmark();
+
+#endif // BTHID_H
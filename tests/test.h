@@ -0,0 +1,103 @@
+// Shared by the unit tests: CHECK records a failure and carries on, and a
+// focused host session on a socketpair stands in for a Bluetooth host.
+#ifndef BTHID_TEST_H
+#define BTHID_TEST_H
+
+#include "bthid.h"
+
+static int test_failures = 0;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #cond ") failed" << std::endl; \
+            test_failures++; \
+        } \
+    } while (0)
+
+// Exit status for main()
+inline int test_result() {
+    if (test_failures) std::cerr << test_failures << " checks failed" << std::endl;
+    return test_failures ? 1 : 0;
+}
+
+// The host end of a loopback session
+struct loopback_t {
+	host_session_t	*session;
+	int		ctl;		// host side of the control channel
+	int		intr;		// host side of the interrupt channel, reports arrive here
+};
+
+// Sets up the pipeline as the emulator does and connects one host with
+// focus, known as peer. Motion is sent per frame, as with --immediate.
+inline loopback_t open_loopback(const char *peer = "loopback") {
+    loopback_t lb = { nullptr, -1, -1 };
+    report_rate_hz = 0;
+    if (!init_pipeline(nullptr, nullptr, nullptr)) return lb;
+    hid_descriptor = build_hid_descriptor();
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+    int ctl[2], intr[2];
+    if (epoll_fd < 0 || socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, ctl) < 0 ||
+        socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, intr) < 0) {
+        std::cerr << "Error setting up the loopback link: " << strerror(errno) << std::endl;
+        return lb;
+    }
+    lb.session = add_session(peer);
+    activate_session(lb.session, ctl[0], intr[0]);
+    focus = lb.session;
+    lb.ctl = ctl[1];
+    lb.intr = intr[1];
+    return lb;
+}
+
+// One turn of the emulator's main loop, waiting up to timeout_ms, ending
+// with the report timer armed if motion is pending; returns the number of
+// events it handled
+inline int loop_turn(int timeout_ms) {
+    struct epoll_event evs[EPOLL_BATCH];
+    int n = epoll_wait(epoll_fd, evs, EPOLL_BATCH, timeout_ms);
+    for (int i = 0; i < n; ++i) {
+        fd_handler_t *handler = static_cast<fd_handler_t *>(evs[i].data.ptr);
+        handler->on_event(handler, evs[i].events);
+    }
+    reap_sessions();
+    arm_report_timer();
+    return n < 0 ? 0 : n;
+}
+
+// Next report the host received, 0 if none is waiting
+inline ssize_t host_recv(const loopback_t& lb, unsigned char *rep, size_t size) {
+    ssize_t len = recv(lb.intr, rep, size, MSG_DONTWAIT);
+    return len < 0 ? 0 : len;
+}
+
+// Host side: sums the motion in the mouse reports it received, letting
+// reports queued behind a congested link through until none are left
+inline void host_catch_up(const loopback_t& lb, int64_t *x, int64_t *y) {
+    unsigned char buf[64];
+    ssize_t len;
+    do {
+        while ((len = host_recv(lb, buf, sizeof(buf))) > 0) {
+            if (buf[1] != REPORTID_MOUSE || len != sizeof(hidrep_mouse_t)) continue;
+            *x += reinterpret_cast<hidrep_mouse_t *>(buf)->axis_x;
+            *y += reinterpret_cast<hidrep_mouse_t *>(buf)->axis_y;
+        }
+        if (!lb.session->send_queue.empty()) drain_send_queue(lb.session);
+    } while (!lb.session->send_queue.empty());
+}
+
+// Feeds one input event from device 0 through the pipeline
+inline void feed(int type, int code, int value) {
+    struct input_event ev = {};
+    ev.type = type;
+    ev.code = code;
+    ev.value = value;
+    process_one_event(&ev, 0);
+}
+
+inline void feed_frame(int type, int code, int value) {
+    feed(type, code, value);
+    feed(EV_SYN, SYN_REPORT, 0);
+}
+
+#endif // BTHID_TEST_H
@@ -0,0 +1,109 @@
+// A host talking on the control and interrupt channels: every message is
+// read and answered once, and the loop sleeps between messages instead of
+// waking up again on data it left unread, so CPU use stays flat. A hi-res
+// host that set the wheel multiplier and then went to the boot protocol
+// does not leave the report timer ticking on wheel motion it cannot get.
+#include "test.h"
+
+uint64_t cpu_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct host_msg_t {
+	unsigned char	bytes[4];
+	size_t		len;
+	bool		answered;	// the device replies on the control channel
+};
+
+// Whether the report timer is set to fire
+bool report_timer_running() {
+    struct itimerspec its = {};
+    timerfd_gettime(report_timer_fd, &its);
+    return its.it_value.tv_sec || its.it_value.tv_nsec;
+}
+
+int main() {
+    mouse_hires = true;
+    loopback_t lb = open_loopback();
+    CHECK(lb.session != nullptr);
+
+    const host_msg_t msgs[] = {
+        { { HIDP_SET_PROTOCOL | HIDP_PROTOCOL_BOOT }, 1, true },
+        { { HIDP_GET_PROTOCOL }, 1, true },
+        { { HIDP_SET_PROTOCOL | HIDP_PROTOCOL_REPORT }, 1, true },
+        { { HIDP_GET_REPORT | HIDP_REPORT_INPUT, REPORTID_KEYBD }, 2, true },
+        { { HIDP_GET_REPORT | HIDP_REPORT_INPUT | HIDP_GET_REPORT_SIZE, REPORTID_MOUSE, 0x40, 0x00 }, 4, true },
+        { { HIDP_SET_REPORT | HIDP_REPORT_OUTPUT, REPORTID_KEYBD, 0x02 }, 3, true },
+        { { HIDP_GET_REPORT | HIDP_REPORT_INPUT, 0x7F }, 2, true },
+        { { HIDP_SET_IDLE, 0x00 }, 2, true },
+        { { HIDP_GET_IDLE }, 1, true },
+        { { 0x30 }, 1, true },					// reserved type: HANDSHAKE unsupported
+        { { HIDP_HID_CONTROL | 0x03 }, 1, false },		// suspend
+    };
+    const size_t n_msgs = sizeof(msgs) / sizeof(msgs[0]);
+    const unsigned char led_report[3] = { HIDP_DATA | HIDP_REPORT_OUTPUT, REPORTID_KEYBD, 0x01 };
+
+    // A message every 5 ms for half a second, each channel in turn
+    const int period_ms = 5, rounds = 100;
+    size_t expected = 0, replies = 0;
+    int wakeups = 0;
+    uint64_t wall_start = monotonic_ns(), cpu_start = cpu_ns();
+    for (int i = 0; i < rounds; ++i) {
+        const host_msg_t& m = msgs[i % n_msgs];
+        if (i % 2) {
+            send(lb.intr, led_report, sizeof(led_report), 0);
+        } else {
+            send(lb.ctl, m.bytes, m.len, 0);
+            expected += m.answered;
+        }
+        uint64_t next = wall_start + (uint64_t)(i + 1) * period_ms * 1000000ULL;
+        // At least one turn, so a round that overran its slot is still handled
+        uint64_t now = monotonic_ns();
+        do {
+            if (loop_turn(now < next ? (next - now + 999999) / 1000000 : 0)) wakeups++;
+        } while ((now = monotonic_ns()) < next);
+        unsigned char reply[64];
+        while (recv(lb.ctl, reply, sizeof(reply), MSG_DONTWAIT) > 0) replies++;
+    }
+    uint64_t wall_ns = monotonic_ns() - wall_start, used_ns = cpu_ns() - cpu_start;
+
+    std::cout << rounds << " host messages in " << wall_ns / 1000000 << " ms: " << wakeups << " wakeups, "
+              << used_ns / 1000 << " us of CPU (" << 100.0 * used_ns / wall_ns << "%)" << std::endl;
+    CHECK(replies == expected);
+    CHECK(wakeups <= rounds);		// one per message, none spent on leftovers
+    CHECK(used_ns < wall_ns / 10);	// a spinning loop would use all of it
+    CHECK(lb.session->up && lb.session->leds == 0x01 && !lb.session->boot_protocol);
+    CHECK(loop_turn(0) == 0);		// nothing left unread
+
+    // Paced reports from here on, through the report timer
+    report_rate_hz = REPORT_RATE_DEFAULT;
+    report_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    report_timer_handler = {report_timer_fd, on_report_timer, nullptr};
+    watch_fd(&report_timer_handler, EPOLLIN);
+
+    const unsigned char multiplier[] = { HIDP_SET_REPORT | HIDP_REPORT_FEATURE, REPORTID_MOUSE, 0x05 };
+    const unsigned char to_boot[] = { HIDP_SET_PROTOCOL | HIDP_PROTOCOL_BOOT };
+    unsigned char reply[64];
+    send(lb.ctl, multiplier, sizeof(multiplier), 0);
+    loop_turn(100);
+    CHECK(lb.session->wheel_multiplier == WHEEL_UNIT);
+    send(lb.ctl, to_boot, sizeof(to_boot), 0);
+    loop_turn(100);
+    CHECK(lb.session->boot_protocol && lb.session->wheel_multiplier == 1);
+    while (recv(lb.ctl, reply, sizeof(reply), MSG_DONTWAIT) > 0) {}
+
+    // Less than a detent down and a tilt the boot report has no field for
+    feed(EV_REL, REL_WHEEL_HI_RES, 30);
+    feed(EV_REL, REL_HWHEEL, 1);
+    feed(EV_SYN, SYN_REPORT, 0);
+    CHECK(dh == 0);
+    int ticks = 0;
+    for (uint64_t until = monotonic_ns() + 50000000ULL; monotonic_ns() < until;) ticks += loop_turn(10);
+    std::cout << "Report timer wakeups on a boot host with sub-detent wheel motion: " << ticks << std::endl;
+    CHECK(ticks <= 1);
+    CHECK(!report_timer_running());
+    close(report_timer_fd);
+    return test_result();
+}
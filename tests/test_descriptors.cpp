@@ -0,0 +1,47 @@
+// The advertised descriptor is the encoded collections the report structs
+// are checked against, in the order and variants the flags select.
+#include "test.h"
+
+template <size_t N>
+bool has_part(const std::string& desc, size_t at, const std::array<unsigned char, N>& bytes) {
+    return desc.size() >= at + N && memcmp(desc.data() + at, bytes.data(), N) == 0;
+}
+
+int main() {
+    std::string desc = build_hid_descriptor();
+    size_t at = 0;
+    CHECK(has_part(desc, at, HID_MOUSE_BYTES));
+    at += HID_MOUSE_BYTES.size();
+    CHECK(has_part(desc, at, HID_KEYBD_BYTES));
+    at += HID_KEYBD_BYTES.size();
+    CHECK(has_part(desc, at, HID_CONSUMER_BYTES));
+    at += HID_CONSUMER_BYTES.size();
+    CHECK(desc.size() == at);
+
+    mouse_hires = keyboard_nkro = gamepad = true;
+    desc = build_hid_descriptor();
+    at = 0;
+    CHECK(has_part(desc, at, HID_MOUSE_HIRES_BYTES));
+    at += HID_MOUSE_HIRES_BYTES.size();
+    CHECK(has_part(desc, at, HID_KEYBD_NKRO_BYTES));
+    at += HID_KEYBD_NKRO_BYTES.size();
+    CHECK(has_part(desc, at, HID_CONSUMER_BYTES));
+    at += HID_CONSUMER_BYTES.size();
+    CHECK(has_part(desc, at, HID_GAMEPAD_BYTES));
+    at += HID_GAMEPAD_BYTES.size();
+    CHECK(desc.size() == at);
+
+    // Usage Page (Generic Desktop), Usage (Mouse), Collection (Application)
+    CHECK(HID_MOUSE_BYTES[0] == 0x05 && HID_MOUSE_BYTES[1] == 0x01);
+    CHECK(HID_MOUSE_BYTES[2] == 0x09 && HID_MOUSE_BYTES[3] == 0x02);
+    CHECK(HID_MOUSE_BYTES[4] == 0xA1 && HID_MOUSE_BYTES[5] == 0x01);
+    // Every collection is closed
+    CHECK(HID_MOUSE_BYTES.back() == 0xC0 && HID_KEYBD_BYTES.back() == 0xC0 &&
+          HID_CONSUMER_BYTES.back() == 0xC0 && HID_GAMEPAD_BYTES.back() == 0xC0);
+
+    // Field ranges the mouse packers clamp to
+    CHECK(mouse_layout<hidrep_mouse_t>::xy.min == -127 && mouse_layout<hidrep_mouse_t>::xy.max == 127);
+    CHECK(mouse_layout<hidrep_mouse_t>::hwheel.min == 0 && mouse_layout<hidrep_mouse_t>::hwheel.max == 0);
+    CHECK(mouse_layout<hidrep_mouse_hires_t>::hwheel.max > 127);
+    return test_result();
+}
@@ -0,0 +1,85 @@
+// The generated keycode tables, key names, and --keymap files applied to
+// input on its way to the keyboard report.
+#include "test.h"
+
+// Writes a keymap to a temporary file and loads it
+bool load_keymap_text(const char *text) {
+    char path[] = "/tmp/bthid-keymap-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) return false;
+    bool ok = write(fd, text, strlen(text)) == (ssize_t)strlen(text);
+    close(fd);
+    ok = ok && load_keymap(path);
+    unlink(path);
+    return ok;
+}
+
+// The newest keyboard report the host has, 0 if it got none since the last call
+ssize_t last_keyb_report(const loopback_t& lb, hidrep_keyb_t *rep) {
+    unsigned char buf[64];
+    ssize_t len, got = 0;
+    while ((len = host_recv(lb, buf, sizeof(buf))) > 0) {
+        if (buf[1] != REPORTID_KEYBD || len != sizeof(*rep)) continue;
+        memcpy(rep, buf, len);
+        got = len;
+    }
+    return got;
+}
+
+int main() {
+    CHECK(map_key_to_hid(KEY_A) == 0x04);
+    CHECK(map_key_to_hid(KEY_ESC) == 0x29);
+    CHECK(map_key_to_hid(KEY_LEFTCTRL) == 0xE0);
+    CHECK(map_key_to_hid(KEY_RIGHTMETA) == 0xE7);
+    CHECK(map_key_to_hid(KEY_VOLUMEUP) == 0);
+    CHECK(map_key_to_consumer(KEY_VOLUMEUP) == 0xE9);
+    CHECK(map_key_to_consumer(KEY_A) == 0);
+    CHECK(map_key_to_hid(KEY_CNT + 5) == 0 && map_key_to_consumer(-1) == 0);
+
+    CHECK(key_by_name("A") == KEY_A);
+    CHECK(key_by_name("key_capslock") == KEY_CAPSLOCK);
+    CHECK(key_by_name("KEY_ESC") == KEY_ESC);
+    CHECK(key_by_name("NOSUCHKEY") == -1);
+
+    CHECK(!load_keymap_text("map CAPSLOCK NOSUCHKEY\n"));
+    CHECK(!load_keymap_text("taphold SPACE SPACE LEFTSHIFT 0\n"));
+    CHECK(!load_keymap_text("map SCROLLLOCK A\n")); // the switch key
+    CHECK(remap_layers.empty());
+
+    loopback_t lb = open_loopback();
+    CHECK(lb.session != nullptr);
+    CHECK(load_keymap_text("map CAPSLOCK ESC   # comment\n"
+                           "layer RIGHTALT nav\n"
+                           "[nav]\n"
+                           "map H LEFT\n"
+                           "map J none\n"));
+    CHECK(remap_layers.size() == 2);
+
+    hidrep_keyb_t rep;
+    feed_frame(EV_KEY, KEY_CAPSLOCK, 1);
+    CHECK(last_keyb_report(lb, &rep) && rep.key[0] == 0x29);
+    feed_frame(EV_KEY, KEY_CAPSLOCK, 0);
+    CHECK(last_keyb_report(lb, &rep) && rep.key[0] == 0);
+
+    // Unmapped keys pass through, in the base layer and in nav
+    feed_frame(EV_KEY, KEY_H, 1);
+    CHECK(last_keyb_report(lb, &rep) && rep.key[0] == 0x0B);
+    feed_frame(EV_KEY, KEY_H, 0);
+    CHECK(last_keyb_report(lb, &rep) && rep.key[0] == 0);
+
+    feed_frame(EV_KEY, KEY_RIGHTALT, 1);
+    feed_frame(EV_KEY, KEY_H, 1);
+    CHECK(last_keyb_report(lb, &rep) && rep.key[0] == 0x50 && rep.modify == 0);
+    feed_frame(EV_KEY, KEY_J, 1);
+    CHECK(!last_keyb_report(lb, &rep)); // J sends nothing in nav
+    feed_frame(EV_KEY, KEY_A, 1);
+    CHECK(last_keyb_report(lb, &rep) && rep.key[0] == 0x04 && rep.key[1] == 0x50); // slots in usage order
+
+    // A key released after its layer is keeps what it was pressed as
+    feed_frame(EV_KEY, KEY_RIGHTALT, 0);
+    feed_frame(EV_KEY, KEY_H, 0);
+    feed_frame(EV_KEY, KEY_J, 0);
+    feed_frame(EV_KEY, KEY_A, 0);
+    CHECK(last_keyb_report(lb, &rep) && rep.key[0] == 0 && rep.modify == 0);
+    return test_result();
+}
@@ -0,0 +1,60 @@
+// Pointer curves: --pointer parsing, the Q16.16 gain table, and motion
+// leaving through the mouse reports with sub-count remainders kept.
+#include "test.h"
+
+// Sums the X motion of the mouse reports the host has, counting them
+int host_motion_x(const loopback_t& lb, int *reports) {
+    unsigned char buf[64];
+    ssize_t len;
+    int x = 0;
+    while ((len = host_recv(lb, buf, sizeof(buf))) > 0) {
+        if (buf[1] != REPORTID_MOUSE || len != sizeof(hidrep_mouse_t)) continue;
+        x += reinterpret_cast<hidrep_mouse_t *>(buf)->axis_x;
+        if (reports) (*reports)++;
+    }
+    return x;
+}
+
+int main() {
+    CHECK(!add_pointer_curve("0"));
+    CHECK(!add_pointer_curve("1,-1"));
+    CHECK(!add_pointer_curve("fast"));
+    CHECK(!add_pointer_curve("1,0.5,2,9"));
+
+    CHECK(add_pointer_curve("Trackball=1,0.5,2"));
+    const pointer_curve_t *tb = pointer_curve_for("Kensington Trackball", "/dev/input/event3");
+    CHECK(tb != &default_curve && tb->match == "Trackball");
+    CHECK(tb->gain[0] == POINTER_ONE && tb->gain[2] == POINTER_ONE);
+    CHECK(tb->gain[4] == 2 * POINTER_ONE);
+    CHECK(tb->gain[POINTER_LUT_SIZE - 1] == POINTER_GAIN_MAX * POINTER_ONE);
+    CHECK(pointer_curve_for("Some Mouse", "/dev/input/event4") == &default_curve);
+
+    loopback_t lb = open_loopback();
+    CHECK(lb.session != nullptr);
+    CHECK(default_curve.gain[0] == POINTER_ONE && default_curve.gain[POINTER_LUT_SIZE - 1] == POINTER_ONE);
+
+    int reports = 0;
+    feed_frame(EV_REL, REL_X, 5);
+    CHECK(host_motion_x(lb, &reports) == 5 && reports == 1);
+
+    // More than a report holds is split, not clamped away
+    reports = 0;
+    feed_frame(EV_REL, REL_X, 300);
+    CHECK(host_motion_x(lb, &reports) == 300 && reports == 3);
+
+    // Half a count per frame: every other frame moves
+    CHECK(add_pointer_curve("0.5"));
+    int moved = 0;
+    for (int i = 0; i < 10; ++i) {
+        feed_frame(EV_REL, REL_X, 1);
+        moved += host_motion_x(lb, nullptr);
+        CHECK(moved == (i + 1) / 2);
+    }
+
+    // Negative motion rounds down too, and what it overshot is given back
+    feed_frame(EV_REL, REL_X, -3);
+    CHECK(host_motion_x(lb, nullptr) == -2);
+    feed_frame(EV_REL, REL_X, 1);
+    CHECK(host_motion_x(lb, nullptr) == 1);
+    return test_result();
+}
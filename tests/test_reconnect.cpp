@@ -0,0 +1,110 @@
+// Device-initiated reconnection over the unix transport, which stands in
+// for L2CAP: the host drops its link with a key held and listens at its
+// address, the emulator pages it back, tells it the key is up, and new
+// input reaches it. Time to first input is measured from the drop. A host
+// that connects again before its old link is seen to drop keeps its one
+// session.
+#include "test.h"
+
+// Listening socket of the host at base + suffix
+int host_listen(const std::string& base, const char *suffix) {
+    struct sockaddr_un addr;
+    std::string path = base + suffix;
+    unlink(path.c_str());
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock < 0 || !unix_addr(path, &addr) || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(sock, 1) < 0) {
+        std::cerr << "Error listening on " << path << ": " << strerror(errno) << std::endl;
+        return -1;
+    }
+    return sock;
+}
+
+// Usage bitmap of the newest keyboard report the host has; false if none came
+bool host_keys(const loopback_t& lb, unsigned char *bits) {
+    unsigned char buf[64];
+    ssize_t len;
+    bool got = false;
+    while ((len = host_recv(lb, buf, sizeof(buf))) > 0) {
+        if (buf[1] != REPORTID_KEYBD) continue;
+        decode_keyb_report(buf, len, bits);
+        got = true;
+    }
+    return got;
+}
+
+int main() {
+    std::string base = "/tmp/bthid-test-host-" + std::to_string(getpid());
+    transport = &transport_unix;
+    reconnect_window = 5;
+    loopback_t lb = open_loopback(base.c_str());
+    CHECK(lb.session != nullptr);
+    reconnect_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    reconnect_timer_handler = {reconnect_timer_fd, on_reconnect_timer, nullptr};
+    watch_fd(&reconnect_timer_handler, EPOLLIN);
+
+    unsigned char keys[32] = {};
+    feed_frame(EV_KEY, KEY_A, 1);
+    CHECK(host_keys(lb, keys) && keybit(keys, 0x04));
+
+    // The link drops; the host waits to be paged
+    int listen_ctl = host_listen(base, ".ctl"), listen_int = host_listen(base, ".int");
+    CHECK(listen_ctl >= 0 && listen_int >= 0);
+    close(lb.ctl);
+    close(lb.intr);
+    lb.ctl = lb.intr = -1;
+    uint64_t dropped = monotonic_ns();
+    loop_turn(0);
+    CHECK(sessions.size() == 1 && !lb.session->up && focus == lb.session);
+
+    // Accept the emulator's control channel first, then its interrupt channel
+    uint64_t deadline = dropped + 5000000000ULL;
+    while ((lb.ctl < 0 || lb.intr < 0 || !lb.session->up) && monotonic_ns() < deadline) {
+        loop_turn(10);
+        if (lb.ctl < 0) lb.ctl = accept4(listen_ctl, nullptr, nullptr, SOCK_CLOEXEC);
+        else if (lb.intr < 0) lb.intr = accept4(listen_int, nullptr, nullptr, SOCK_CLOEXEC);
+    }
+    CHECK(lb.ctl >= 0 && lb.intr >= 0 && lb.session->up);
+
+    // The key held before the drop is released first, then input flows
+    memset(keys, 0xFF, sizeof(keys));
+    CHECK(host_keys(lb, keys) && !keybit(keys, 0x04));
+    feed_frame(EV_KEY, KEY_B, 1);
+    CHECK(host_keys(lb, keys) && keybit(keys, 0x05) && keybit(keys, 0x04));
+    uint64_t first_input_ms = (monotonic_ns() - dropped) / 1000000;
+    std::cout << "Time to first input after the drop: " << first_input_ms << " ms" << std::endl;
+
+    // The page starts after the grace period given to the host, and the
+    // channel setup itself adds next to nothing
+    CHECK(first_input_ms >= RECONNECT_BACKOFF_MIN_MS);
+    CHECK(first_input_ms < RECONNECT_BACKOFF_MIN_MS + 200);
+    CHECK(sessions.size() == 1);
+
+    // A silent drop: the host connects again while its old link looks up
+    int ctl[2], intr[2];
+    CHECK(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, ctl) == 0);
+    CHECK(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, intr) == 0);
+    host_connected(ctl[0], intr[0], base);
+    CHECK(sessions.size() == 1 && focus == lb.session);
+    CHECK(lb.session->up && lb.session->ctl == ctl[0] && lb.session->intr == intr[0]);
+    unsigned char buf[64];
+    CHECK(recv(lb.intr, buf, sizeof(buf), MSG_DONTWAIT) == 0);	// the stale link is closed
+    close(lb.ctl);
+    close(lb.intr);
+    lb.ctl = ctl[1];
+    lb.intr = intr[1];
+
+    // As after any drop the new link starts from all keys up, then input flows
+    memset(keys, 0xFF, sizeof(keys));
+    CHECK(host_keys(lb, keys) && !keybit(keys, 0x04) && !keybit(keys, 0x05));
+    feed_frame(EV_KEY, KEY_C, 1);
+    CHECK(host_keys(lb, keys) && keybit(keys, 0x04) && keybit(keys, 0x05) && keybit(keys, 0x06));
+    loop_turn(0);
+    CHECK(sessions.size() == 1 && lb.session->up);
+
+    close(listen_ctl);
+    close(listen_int);
+    unlink((base + ".ctl").c_str());
+    unlink((base + ".int").c_str());
+    return test_result();
+}
@@ -0,0 +1,117 @@
+// Input events in, encoded reports out: one report per changed frame, in
+// the protocol the host asked for.
+#include "test.h"
+
+// Reads every report the host has into reps, returns how many there were
+int host_reports(const loopback_t& lb, std::vector<std::string> *reps) {
+    unsigned char buf[64];
+    ssize_t len;
+    int n = 0;
+    reps->clear();
+    while ((len = host_recv(lb, buf, sizeof(buf))) > 0) {
+        reps->push_back(std::string(reinterpret_cast<const char *>(buf), len));
+        n++;
+    }
+    return n;
+}
+
+std::string bytes(std::initializer_list<unsigned char> b) {
+    return std::string(b.begin(), b.end());
+}
+
+int main() {
+    loopback_t lb = open_loopback();
+    CHECK(lb.session != nullptr);
+    std::vector<std::string> reps;
+
+    // Shift+A, both in one frame: one report
+    feed(EV_KEY, KEY_LEFTSHIFT, 1);
+    feed(EV_KEY, KEY_A, 1);
+    feed(EV_SYN, SYN_REPORT, 0);
+    CHECK(host_reports(lb, &reps) == 1);
+    CHECK(reps[0] == bytes({ 0xA1, REPORTID_KEYBD, 0x02, 0, 0x04, 0, 0, 0, 0, 0 }));
+
+    // Autorepeat and a frame that changes nothing send nothing
+    feed_frame(EV_KEY, KEY_A, 2);
+    feed_frame(EV_MSC, MSC_SCAN, 0x1E);
+    CHECK(host_reports(lb, &reps) == 0);
+
+    feed(EV_KEY, KEY_A, 0);
+    feed(EV_KEY, KEY_LEFTSHIFT, 0);
+    feed(EV_SYN, SYN_REPORT, 0);
+    CHECK(host_reports(lb, &reps) == 1);
+    CHECK(reps[0] == bytes({ 0xA1, REPORTID_KEYBD, 0, 0, 0, 0, 0, 0, 0, 0 }));
+
+    // Media keys go out on the consumer page
+    feed_frame(EV_KEY, KEY_VOLUMEUP, 1);
+    feed_frame(EV_KEY, KEY_VOLUMEUP, 0);
+    CHECK(host_reports(lb, &reps) == 2);
+    CHECK(reps[0] == bytes({ 0xA1, REPORTID_CONSUMER, 0xE9, 0x00 }));
+    CHECK(reps[1] == bytes({ 0xA1, REPORTID_CONSUMER, 0x00, 0x00 }));
+
+    // A click with motion in the same frame rides in one report; the wheel
+    // comes in whole detents
+    feed(EV_KEY, BTN_LEFT, 1);
+    feed(EV_REL, REL_X, 3);
+    feed(EV_REL, REL_Y, -4);
+    feed(EV_REL, REL_WHEEL, 1);
+    feed(EV_SYN, SYN_REPORT, 0);
+    CHECK(host_reports(lb, &reps) == 1);
+    CHECK(reps[0] == bytes({ 0xA1, REPORTID_MOUSE, 0x01, 3, 0xFC, 1 }));
+    feed_frame(EV_KEY, BTN_LEFT, 0);
+    CHECK(host_reports(lb, &reps) == 1);
+    CHECK(reps[0] == bytes({ 0xA1, REPORTID_MOUSE, 0x00, 0, 0, 0 }));
+
+    // The host switches to the boot protocol: handshake, then boot report IDs
+    unsigned char set_boot = HIDP_SET_PROTOCOL | HIDP_PROTOCOL_BOOT;
+    handle_control_message(lb.session, &set_boot, 1);
+    unsigned char hshk;
+    CHECK(recv(lb.ctl, &hshk, 1, MSG_DONTWAIT) == 1 && hshk == (HIDP_HANDSHAKE | HIDP_HSHK_SUCCESS));
+    feed(EV_SYN, SYN_REPORT, 0); // the state is sent again in the new format
+    host_reports(lb, &reps);
+    feed_frame(EV_KEY, KEY_B, 1);
+    feed_frame(EV_KEY, KEY_VOLUMEDOWN, 1);
+    feed_frame(EV_REL, REL_X, 1);
+    CHECK(host_reports(lb, &reps) == 2); // No consumer report in boot mode
+    CHECK(reps[0] == bytes({ 0xA1, BOOT_REPORTID_KEYBD, 0, 0, 0x05, 0, 0, 0, 0, 0 }));
+    CHECK(reps[1] == bytes({ 0xA1, BOOT_REPORTID_MOUSE, 0, 1, 0, 0 }));
+
+    unsigned char set_report = HIDP_SET_PROTOCOL | HIDP_PROTOCOL_REPORT;
+    handle_control_message(lb.session, &set_report, 1);
+    recv(lb.ctl, &hshk, 1, MSG_DONTWAIT);
+    feed_frame(EV_KEY, KEY_B, 0);
+    feed_frame(EV_KEY, KEY_VOLUMEDOWN, 0);
+    host_reports(lb, &reps);
+    CHECK(!reps.empty() && reps.back() == bytes({ 0xA1, REPORTID_CONSUMER, 0x00, 0x00 }));
+
+    // N-key rollover: a bitmap instead of six slots
+    keyboard_nkro = true;
+    reset_report_history(lb.session);
+    for (int code = KEY_1; code <= KEY_8; ++code) feed(EV_KEY, code, 1);
+    feed(EV_SYN, SYN_REPORT, 0);
+    CHECK(host_reports(lb, &reps) == 1 && reps[0].size() == sizeof(hidrep_keyb_nkro_t));
+    const unsigned char *bits = reinterpret_cast<const unsigned char *>(reps[0].data()) + 2;
+    for (int usage = 0x1E; usage <= 0x25; ++usage) CHECK(keybit(bits, usage));
+    CHECK(!keybit(bits, 0x26));
+
+    // Focus switch: the host gaining focus gets the keys and buttons held
+    // across it with the switch frame, not on the next input
+    keyboard_nkro = false;
+    for (int code = KEY_1; code <= KEY_8; ++code) feed(EV_KEY, code, 0);
+    feed(EV_KEY, KEY_A, 1);
+    feed(EV_KEY, BTN_LEFT, 1);
+    feed(EV_SYN, SYN_REPORT, 0);
+    host_reports(lb, &reps);
+    int ctl[2], intr[2];
+    CHECK(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, ctl) == 0);
+    CHECK(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, intr) == 0);
+    loopback_t second = { add_session("second"), ctl[1], intr[1] };
+    activate_session(second.session, ctl[0], intr[0]);
+    feed_frame(EV_KEY, switch_key, 1);
+    CHECK(focus == second.session);
+    CHECK(host_reports(lb, &reps) > 0);
+    CHECK(host_reports(second, &reps) == 2);
+    CHECK(reps.size() == 2 && reps[0] == bytes({ 0xA1, REPORTID_KEYBD, 0, 0, 0x04, 0, 0, 0, 0, 0 }));
+    CHECK(reps.size() == 2 && reps[1] == bytes({ 0xA1, REPORTID_MOUSE, 0x01, 0, 0, 0 }));
+    return test_result();
+}
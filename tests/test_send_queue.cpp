@@ -0,0 +1,83 @@
+// A congested interrupt channel: reports queue and merge instead of being
+// lost, the queue stays bounded, motion waits in the accumulators, and
+// everything reaches the host once it reads again.
+#include "test.h"
+
+// Final keyboard state and total X motion of everything the host has
+struct host_view_t {
+	unsigned char	keys[32];
+	int		x;
+	int		reports;
+};
+
+void host_read_all(const loopback_t& lb, host_view_t *v) {
+    unsigned char buf[64];
+    ssize_t len;
+    while ((len = host_recv(lb, buf, sizeof(buf))) > 0) {
+        v->reports++;
+        if (buf[1] == REPORTID_KEYBD) decode_keyb_report(buf, len, v->keys);
+        if (buf[1] == REPORTID_MOUSE) v->x += reinterpret_cast<hidrep_mouse_t *>(buf)->axis_x;
+    }
+}
+
+int main() {
+    // Mouse reports fold into each other while the buttons match and the sum fits
+    hidrep_mouse_t a = { 0xA1, REPORTID_MOUSE, 1, 100, -5, 0 }, b = { 0xA1, REPORTID_MOUSE, 1, 27, -5, 1 };
+    CHECK(merge_mouse_report((unsigned char *)&a, (const unsigned char *)&b, sizeof(a)));
+    CHECK(a.axis_x == 127 && a.axis_y == -10 && a.axis_z == 1);
+    CHECK(!merge_mouse_report((unsigned char *)&a, (const unsigned char *)&b, sizeof(a)));
+    b.button = 0;
+    b.axis_x = 0;
+    CHECK(!merge_mouse_report((unsigned char *)&a, (const unsigned char *)&b, sizeof(a)));
+
+    loopback_t lb = open_loopback();
+    CHECK(lb.session != nullptr);
+    host_session_t *s = lb.session;
+
+    // Type until the link stops taking reports
+    int taps = 0;
+    while (s->send_queue.empty() && taps < 100000) {
+        feed_frame(EV_KEY, KEY_A, 1);
+        feed_frame(EV_KEY, KEY_A, 0);
+        taps++;
+    }
+    CHECK(!s->send_queue.empty() && s->draining);
+    CHECK(metrics.stalls.load() == 1);
+
+    // A tap queues as a press and a release; the next key replaces the release
+    size_t depth = s->send_queue.size();
+    feed_frame(EV_KEY, KEY_B, 1);
+    feed_frame(EV_KEY, KEY_B, 0);
+    feed_frame(EV_KEY, KEY_C, 1);
+    CHECK(s->send_queue.size() <= depth + 2);
+    feed_frame(EV_KEY, KEY_C, 0);
+
+    // Motion is held back rather than queued
+    depth = s->send_queue.size();
+    for (int i = 0; i < 50; ++i) feed_frame(EV_REL, REL_X, 10);
+    CHECK(s->send_queue.size() == depth);
+    CHECK(dx == 500 * POINTER_ONE);
+
+    // However long it lasts, the queue stays bounded
+    for (int i = 0; i < 10 * SEND_QUEUE_MAX; ++i) {
+        feed_frame(EV_KEY, KEY_1 + i % 9, 1);
+        feed_frame(EV_KEY, KEY_1 + i % 9, 0);
+    }
+    feed_frame(EV_KEY, KEY_Z, 1);
+    CHECK(s->send_queue.size() <= SEND_QUEUE_MAX);
+    CHECK(metrics.merged.load() > 0);
+
+    // The host catches up: the queue drains, then the held motion follows
+    host_view_t v = {};
+    for (int round = 0; round < 1000 && (!s->send_queue.empty() || v.x < 500); ++round) {
+        host_read_all(lb, &v);
+        drain_send_queue(s);
+    }
+    host_read_all(lb, &v);
+    CHECK(s->send_queue.empty() && !s->draining);
+    CHECK(v.x == 500);
+    CHECK(keybit(v.keys, 0x1D)); // Z still down
+    for (int usage = 0x04; usage < 0x1D; ++usage) CHECK(!keybit(v.keys, usage));
+    CHECK(report_stats.sent == (uint64_t)v.reports);
+    return test_result();
+}